@@ -5,11 +5,16 @@
 #include <linux/clk.h>
 #include <linux/err.h>
 #include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/events.h>
 #include <linux/iio/driver.h>
+#include <linux/iio/kfifo_buf.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/platform_device.h>
+#include <linux/spinlock.h>
 #include <linux/wait.h>
 
 #include "x8h7.h"
@@ -22,21 +27,147 @@
 // Peripheral code
 #define X8H7_ADC_PERIPH   0x01
 // Op code
-#define X8H7_ADC_OC_CONFIGURE      0x10
-#define X8H7_ADC_OC_DATA           0x01
+#define X8H7_ADC_OC_CONFIGURE      0x10 // struct adcConfigPacket
+#define X8H7_ADC_OC_STREAM_START   0x11 // struct adcStreamPacket
+#define X8H7_ADC_OC_STREAM_STOP    0x12 // no data
+#define X8H7_ADC_OC_THRESH_CFG     0x13 // struct adcThreshPacket
+#define X8H7_ADC_OC_DATA           0x01 // 0x01 + ch, req: tag, rsp: value + tag
+#define X8H7_ADC_OC_STREAM_DATA    0x20 // one or more scans, enabled channels only
+#define X8H7_ADC_OC_SCAN           0x21 // req: channel mask, rsp: mask + values
+#define X8H7_ADC_OC_EVENT          0x22 // one or more struct adcEventPacket
 
 #define X8H7_ADC_NUM  8
 
-struct x8h7_adc_val {
+// single reads in flight
+#define X8H7_ADC_REQ_NUM  16
+
+// value cache, disabled by default
+#define X8H7_ADC_CACHE_MAX_AGE_MS_MAX  60000
+
+#define X8H7_ADC_SAMP_FREQ_DEF   1000
+#define X8H7_ADC_SAMP_FREQ_MAX   100000
+
+#define X8H7_ADC_SMP_TIME_DEF    0 // 1.5 cycles
+
+/*
+ * Conversion settings. H7 oversamples and right shifts, so the result
+ * is the average of oversampling conversions and keeps 16 bits.
+ * sample_time is the STM32H7 SMP code, see x8h7_adc_smp_cycles.
+ */
+struct __attribute__((packed)) adcConfigPacket {
+  uint16_t oversampling;
+  uint8_t  sample_time;
+  uint32_t freq_hz;
+};
+
+// threshold flags
+#define X8H7_ADC_THRESH_RISING   0x01
+#define X8H7_ADC_THRESH_FALLING  0x02
+
+/*
+ * H7 compares every conversion of ch and reports a crossing once:
+ * rising when value goes above rising, re-armed when it falls below
+ * rising - hysteresis, falling the other way around.
+ */
+struct __attribute__((packed)) adcThreshPacket {
+  uint8_t  ch;
+  uint8_t  flags;
+  uint16_t rising;
+  uint16_t falling;
+  uint16_t hysteresis;
+};
+
+struct __attribute__((packed)) adcEventPacket {
+  uint8_t  ch;
+  uint8_t  flags; // X8H7_ADC_THRESH_RISING or X8H7_ADC_THRESH_FALLING
+};
+
+/*
+ * H7 samples the channels in mask every 1/freq_hz seconds and pushes
+ * the scans with X8H7_ADC_OC_STREAM_DATA, packing as many scans as fit
+ * in a sub-packet after a struct adcStreamHeader. A scan holds one
+ * uint16_t per enabled channel in ascending channel order.
+ */
+struct __attribute__((packed)) adcStreamPacket {
+  uint8_t  mask;
+  uint32_t freq_hz;
+};
+
+/*
+ * H7 timer value when the first scan of the sub-packet was sampled,
+ * following scans are 1/freq_hz apart.
+ */
+struct __attribute__((packed)) adcStreamHeader {
+  uint32_t ts_us;
+};
+
+/*
+ * Maps H7 time to host time. H7 time is extended to 64 bit ns, offset
+ * is the smallest host - H7 difference seen, transport delays only make
+ * it bigger. It creeps up slowly so clock drift is followed.
+ */
+#define X8H7_ADC_TS_CREEP_SHIFT  8
+
+struct x8h7_adc_ts {
+  bool                valid;
+  uint32_t            last_us;
+  s64                 h7_ns;
+  s64                 offset;
+};
+
+/*
+ * Single channel read in flight. The tag sent with the request comes
+ * back with the value, firmware that does not echo it answers in
+ * request order per channel. Without tags a late answer to a timed out
+ * request can not be told apart and is taken by the next read of the
+ * channel.
+ */
+struct x8h7_adc_req {
+  bool                busy;
+  bool                done;
+  uint8_t             ch;
+  uint8_t             tag;
+  uint16_t            val;
+};
+
+/*
+ * Last value seen for a channel, from single reads, scans or streaming
+ */
+struct x8h7_adc_cache {
+  bool                valid;
   uint16_t            val;
-  wait_queue_head_t   wait;
-  int                 cnt;
+  ktime_t             time;
 };
 
 struct x8h7_adc {
   struct device      *dev;
-  struct mutex        lock;
-  struct x8h7_adc_val val[X8H7_ADC_NUM];
+  struct iio_dev     *indio_dev;
+  struct mutex        lock;   // configuration and scans
+  spinlock_t          req_lock;
+  wait_queue_head_t   req_wait;
+  struct x8h7_adc_req req[X8H7_ADC_REQ_NUM];
+  uint8_t             req_tag;
+  bool                req_tagged;   // H7 echoes request tags
+  int                 req_cnt;      // single reads in flight
+  bool                streaming;    // single reads refused
+  /* protected by req_lock */
+  struct x8h7_adc_cache cache[X8H7_ADC_NUM];
+  unsigned int        cache_max_age_ms;
+  /* X8H7_ADC_OC_SCAN response, indexed by channel */
+  uint16_t            scan_val[X8H7_ADC_NUM];
+  uint8_t             scan_mask;
+  wait_queue_head_t   scan_wait;
+  int                 scan_cnt;
+  uint32_t            samp_freq;
+  uint16_t            oversampling;
+  uint8_t             sample_time;
+  struct adcThreshPacket thresh[X8H7_ADC_NUM];
+  struct x8h7_adc_ts  ts;
+  /* scan pushed to the buffer, one slot per channel plus timestamp */
+  struct {
+    uint16_t          val[X8H7_ADC_NUM];
+    s64               ts __aligned(8);
+  } scan;
 };
 
 #define X8H7_ADC_CHAN(_idx) {                          \
@@ -45,8 +176,46 @@ struct x8h7_adc {
   .channel                  = _idx,                    \
   .info_mask_separate       = BIT(IIO_CHAN_INFO_RAW),  \
   .info_mask_shared_by_type = BIT(IIO_CHAN_INFO_SCALE),\
+  .info_mask_shared_by_all  = BIT(IIO_CHAN_INFO_SAMP_FREQ) |  \
+                              BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO),\
+  .info_mask_shared_by_all_available =                 \
+                              BIT(IIO_CHAN_INFO_OVERSAMPLING_RATIO),\
+  .event_spec               = x8h7_adc_events,         \
+  .num_event_specs          = ARRAY_SIZE(x8h7_adc_events),\
+  .scan_index               = _idx,                    \
+  .scan_type = {                                       \
+    .sign        = 'u',                                \
+    .realbits    = 16,                                 \
+    .storagebits = 16,                                 \
+    .endianness  = IIO_CPU,                            \
+  },                                                   \
 }
 
+static const int x8h7_adc_oversampling_avail[] = {
+  1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024,
+};
+
+/* STM32H7 ADC sampling time in ADC clock cycles, index is the SMP code */
+static const char * const x8h7_adc_smp_cycles[] = {
+  "1.5", "2.5", "8.5", "16.5", "32.5", "64.5", "387.5", "810.5",
+};
+
+static const struct iio_event_spec x8h7_adc_events[] = {
+  {
+    .type = IIO_EV_TYPE_THRESH,
+    .dir  = IIO_EV_DIR_RISING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  }, {
+    .type = IIO_EV_TYPE_THRESH,
+    .dir  = IIO_EV_DIR_FALLING,
+    .mask_separate = BIT(IIO_EV_INFO_VALUE) | BIT(IIO_EV_INFO_ENABLE),
+  }, {
+    .type = IIO_EV_TYPE_THRESH,
+    .dir  = IIO_EV_DIR_EITHER,
+    .mask_separate = BIT(IIO_EV_INFO_HYSTERESIS),
+  },
+};
+
 static const struct iio_chan_spec x8h7_adc_iio_channels[] = {
   X8H7_ADC_CHAN(0),
   X8H7_ADC_CHAN(1),
@@ -56,43 +225,365 @@ static const struct iio_chan_spec x8h7_adc_iio_channels[] = {
   X8H7_ADC_CHAN(5),
   X8H7_ADC_CHAN(6),
   X8H7_ADC_CHAN(7),
+  IIO_CHAN_SOFT_TIMESTAMP(X8H7_ADC_NUM),
 };
 
+/**
+ * Store a fresh channel value
+ */
+static void x8h7_adc_cache_put(struct x8h7_adc *adc, unsigned int ch,
+                               uint16_t val)
+{
+  spin_lock(&adc->req_lock);
+  adc->cache[ch].val   = val;
+  adc->cache[ch].time  = ktime_get();
+  adc->cache[ch].valid = true;
+  spin_unlock(&adc->req_lock);
+}
+
+/**
+ * Cached channel value if not older than cache_max_age_ms, -ENODATA
+ * otherwise
+ */
+static int x8h7_adc_cache_get(struct x8h7_adc *adc, unsigned int ch)
+{
+  int ret = -ENODATA;
+
+  spin_lock(&adc->req_lock);
+  if (adc->cache_max_age_ms && adc->cache[ch].valid &&
+      (ktime_ms_delta(ktime_get(), adc->cache[ch].time) <=
+       adc->cache_max_age_ms)) {
+    ret = adc->cache[ch].val;
+  }
+  spin_unlock(&adc->req_lock);
+  return ret;
+}
+
+/**
+ * Forget all cached values, they were sampled with old settings
+ */
+static void x8h7_adc_cache_clear(struct x8h7_adc *adc)
+{
+  int i;
+
+  spin_lock(&adc->req_lock);
+  for (i = 0; i < X8H7_ADC_NUM; i++) {
+    adc->cache[i].valid = false;
+  }
+  spin_unlock(&adc->req_lock);
+}
+
+/**
+ * H7 timer in us to host time in ns, see struct x8h7_adc_ts
+ */
+static s64 x8h7_adc_ts_map(struct x8h7_adc *adc, uint32_t ts_us, s64 now)
+{
+  struct x8h7_adc_ts *ts = &adc->ts;
+  s64                 offset;
+
+  if (!ts->valid) {
+    ts->h7_ns  = (s64)ts_us * NSEC_PER_USEC;
+    ts->offset = now - ts->h7_ns;
+    ts->valid  = true;
+  } else {
+    ts->h7_ns += (s64)(uint32_t)(ts_us - ts->last_us) * NSEC_PER_USEC;
+  }
+  ts->last_us = ts_us;
+
+  offset = now - ts->h7_ns;
+  if (offset < ts->offset) {
+    ts->offset = offset;
+  } else {
+    ts->offset += (offset - ts->offset) >> X8H7_ADC_TS_CREEP_SHIFT;
+  }
+  return ts->h7_ns + ts->offset;
+}
+
+/**
+ * Split a X8H7_ADC_OC_STREAM_DATA sub-packet into scans and push them
+ * with the H7 sampling time mapped to the host clock.
+ * Channels come in the order of the active scan mask, same layout as
+ * the kfifo buffer.
+ */
+static void x8h7_adc_stream_data(struct x8h7_adc *adc, x8h7_pkt_t *pkt)
+{
+  struct iio_dev          *indio_dev = adc->indio_dev;
+  struct adcStreamHeader  *hdr = (struct adcStreamHeader *)pkt->data;
+  unsigned int             scan_bytes;
+  unsigned int             off;
+  unsigned int             n;
+  unsigned int             ch;
+  s64                      period;
+  s64                      ts;
+
+  if (!iio_buffer_enabled(indio_dev) || (pkt->size < sizeof(*hdr))) {
+    return;
+  }
+  scan_bytes = bitmap_weight(indio_dev->active_scan_mask,
+                             X8H7_ADC_NUM) * sizeof(uint16_t);
+  if (!scan_bytes) {
+    return;
+  }
+  n = (pkt->size - sizeof(*hdr)) / scan_bytes;
+  if (!n) {
+    return;
+  }
+  /* Map the newest scan, it is the closest to the arrival time */
+  period = div_u64(NSEC_PER_SEC, adc->samp_freq);
+  ts = x8h7_adc_ts_map(adc, hdr->ts_us + div_u64((u64)(n - 1) * USEC_PER_SEC,
+                                                  adc->samp_freq),
+                       iio_get_time_ns(indio_dev));
+  ts -= (n - 1) * period;
+
+  for (off = sizeof(*hdr); off + scan_bytes <= pkt->size; off += scan_bytes) {
+    memcpy(adc->scan.val, pkt->data + off, scan_bytes);
+    iio_push_to_buffers_with_timestamp(indio_dev, &adc->scan, ts);
+    ts += period;
+  }
+
+  /* Newest scan feeds the cache */
+  n = 0;
+  for_each_set_bit(ch, indio_dev->active_scan_mask, X8H7_ADC_NUM) {
+    x8h7_adc_cache_put(adc, ch, adc->scan.val[n++]);
+  }
+}
+
+/**
+ * X8H7_ADC_OC_SCAN response: channel mask followed by one uint16_t per
+ * channel in the mask, ascending order
+ */
+static void x8h7_adc_scan_data(struct x8h7_adc *adc, x8h7_pkt_t *pkt)
+{
+  uint16_t  *data = (uint16_t *)(pkt->data + 1);
+  uint8_t    mask;
+  int        ch;
+  int        n = 0;
+
+  if (pkt->size < 1) {
+    return;
+  }
+  mask = pkt->data[0];
+  for (ch = 0; ch < X8H7_ADC_NUM; ch++) {
+    if (!(mask & BIT(ch))) {
+      continue;
+    }
+    if (1 + (n + 1) * sizeof(uint16_t) > pkt->size) {
+      mask &= ~BIT(ch);
+      continue;
+    }
+    adc->scan_val[ch] = data[n++];
+    x8h7_adc_cache_put(adc, ch, adc->scan_val[ch]);
+  }
+  adc->scan_mask = mask;
+  adc->scan_cnt++;
+  wake_up_interruptible(&adc->scan_wait);
+}
+
+/**
+ * Threshold crossings detected by H7
+ */
+static void x8h7_adc_event(struct x8h7_adc *adc, x8h7_pkt_t *pkt)
+{
+  struct adcEventPacket  *evt = (struct adcEventPacket *)pkt->data;
+  enum iio_event_direction dir;
+  s64                     ts = iio_get_time_ns(adc->indio_dev);
+  int                     i;
+
+  for (i = 0; i < pkt->size / sizeof(*evt); i++, evt++) {
+    if (evt->ch >= X8H7_ADC_NUM) {
+      continue;
+    }
+    dir = (evt->flags & X8H7_ADC_THRESH_RISING) ? IIO_EV_DIR_RISING :
+                                                  IIO_EV_DIR_FALLING;
+    DBG_PRINT("event ch %d flags %02X\n", evt->ch, evt->flags);
+    iio_push_event(adc->indio_dev,
+                   IIO_UNMOD_EVENT_CODE(IIO_VOLTAGE, evt->ch,
+                                        IIO_EV_TYPE_THRESH, dir),
+                   ts);
+  }
+}
+
+/**
+ * Match a single read response with its request. Untagged responses
+ * go to the oldest request for the channel.
+ */
+static void x8h7_adc_req_done(struct x8h7_adc *adc, uint8_t ch,
+                              uint16_t val, bool tagged, uint8_t tag)
+{
+  struct x8h7_adc_req *req = NULL;
+  struct x8h7_adc_req *r;
+  int                  i;
+
+  spin_lock(&adc->req_lock);
+  if (tagged) {
+    adc->req_tagged = true;
+  }
+  for (i = 0; i < X8H7_ADC_REQ_NUM; i++) {
+    r = &adc->req[i];
+    if (!r->busy || r->done || (r->ch != ch)) {
+      continue;
+    }
+    if (tagged) {
+      if (r->tag == tag) {
+        req = r;
+        break;
+      }
+    } else if (!req || ((int8_t)(r->tag - req->tag) < 0)) {
+      req = r;
+    }
+  }
+  if (req) {
+    req->val  = val;
+    req->done = true;
+  }
+  spin_unlock(&adc->req_lock);
+
+  if (req) {
+    wake_up_interruptible(&adc->req_wait);
+  } else {
+    DBG_ERROR("unexpected value for ch %d\n", ch);
+  }
+}
+
 static void x8h7_adc_hook(void *priv, x8h7_pkt_t *pkt)
 {
   struct x8h7_adc  *adc = (struct x8h7_adc*)priv;
   uint8_t           ch;
 
+  if (pkt->opcode == X8H7_ADC_OC_STREAM_DATA) {
+    x8h7_adc_stream_data(adc, pkt);
+    return;
+  }
+  if (pkt->opcode == X8H7_ADC_OC_SCAN) {
+    x8h7_adc_scan_data(adc, pkt);
+    return;
+  }
+  if (pkt->opcode == X8H7_ADC_OC_EVENT) {
+    x8h7_adc_event(adc, pkt);
+    return;
+  }
+
   ch = pkt->opcode - 1;
-  if (ch < X8H7_ADC_NUM) {
-    adc->val[ch].val = *((uint16_t*)pkt->data);
-    adc->val[ch].cnt++;
-    wake_up_interruptible(&adc->val[ch].wait);
+  if ((ch < X8H7_ADC_NUM) && (pkt->size >= sizeof(uint16_t))) {
+    if (pkt->size > sizeof(uint16_t)) {
+      x8h7_adc_req_done(adc, ch, *((uint16_t*)pkt->data), true, pkt->data[2]);
+    } else {
+      x8h7_adc_req_done(adc, ch, *((uint16_t*)pkt->data), false, 0);
+    }
   }
 }
 
-static int x8h7_adc_pkt_get(struct x8h7_adc *adc, unsigned int ch)
+/**
+ * Take a free request slot, NULL if all are in flight,
+ * -EBUSY while the H7 is streaming
+ */
+static struct x8h7_adc_req *x8h7_adc_req_get(struct x8h7_adc *adc,
+                                             unsigned int ch)
+{
+  struct x8h7_adc_req *req = NULL;
+  int                  i;
+
+  spin_lock(&adc->req_lock);
+  if (adc->streaming) {
+    spin_unlock(&adc->req_lock);
+    return ERR_PTR(-EBUSY);
+  }
+  for (i = 0; i < X8H7_ADC_REQ_NUM; i++) {
+    if (!adc->req[i].busy) {
+      adc->req_cnt++;
+      req = &adc->req[i];
+      req->busy = true;
+      req->done = false;
+      req->ch   = ch;
+      req->tag  = adc->req_tag++;
+      break;
+    }
+  }
+  spin_unlock(&adc->req_lock);
+  return req;
+}
+
+static int x8h7_adc_read_chan(struct x8h7_adc *adc, unsigned int ch)
+{
+  struct x8h7_adc_req *req;
+  long                 ret;
+  bool                 done;
+  bool                 tagged;
+  int                  val;
+
+  ret = wait_event_interruptible(adc->req_wait,
+                                 (req = x8h7_adc_req_get(adc, ch)) != NULL);
+  if (ret) {
+    return ret;
+  }
+  if (IS_ERR(req)) {
+    return PTR_ERR(req);
+  }
+
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_DATA + ch, 1, &req->tag);
+  ret = wait_event_interruptible_timeout(adc->req_wait, req->done,
+                                         X8H7_RX_TIMEOUT);
+
+  spin_lock(&adc->req_lock);
+  done   = req->done;
+  val    = req->val;
+  tagged = adc->req_tagged;
+  req->busy = false;
+  adc->req_cnt--;
+  spin_unlock(&adc->req_lock);
+  /* Slot free again */
+  wake_up_interruptible(&adc->req_wait);
+
+  if (!done) {
+    DBG_ERROR("timeout expired");
+    if (ret < 0) {
+      return ret;
+    }
+    /* Untagged firmware: the next read of ch may get this late answer */
+    return tagged ? -ETIMEDOUT : -EIO;
+  }
+  x8h7_adc_cache_put(adc, ch, val);
+  return val;
+}
+
+/**
+ * Read all channels in mask with a single request.
+ * Returns the mask of channels actually read. Called with adc->lock held.
+ */
+static int x8h7_adc_scan(struct x8h7_adc *adc, uint8_t mask)
 {
   long ret;
 
-  ret = wait_event_interruptible_timeout(adc->val[ch].wait,
-                                         adc->val[ch].cnt != 0,
+  adc->scan_cnt = 0;
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_SCAN, 1, &mask);
+  ret = wait_event_interruptible_timeout(adc->scan_wait,
+                                         adc->scan_cnt != 0,
                                          X8H7_RX_TIMEOUT);
   if (!ret) {
     DBG_ERROR("timeout expired");
-    return -1;
+    return -ETIMEDOUT;
   }
-  adc->val[ch].cnt--;
-  return 0;
+  if (ret < 0) {
+    return ret;
+  }
+  adc->scan_cnt--;
+  return adc->scan_mask;
 }
 
-static int x8h7_adc_read_chan(struct x8h7_adc *adc, unsigned int ch)
+/**
+ * Send conversion settings. Called with adc->lock held.
+ */
+static void x8h7_adc_configure(struct x8h7_adc *adc)
 {
-  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, ch + 1, 0, NULL);
-  if (x8h7_adc_pkt_get(adc, ch) < 0)
-    return -ETIMEDOUT;
+  struct adcConfigPacket pkt;
 
-  return adc->val[ch].val;
+  pkt.oversampling = adc->oversampling;
+  pkt.sample_time  = adc->sample_time;
+  pkt.freq_hz      = adc->samp_freq;
+  DBG_PRINT("oversampling %d smp %d freq %d\n",
+            pkt.oversampling, pkt.sample_time, pkt.freq_hz);
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_CONFIGURE,
+                     sizeof(pkt), &pkt);
 }
 
 static int x8h7_adc_read_raw(struct iio_dev *indio_dev,
@@ -100,15 +591,30 @@ static int x8h7_adc_read_raw(struct iio_dev *indio_dev,
                              int *val, int *val2, long mask)
 {
   struct x8h7_adc *adc = iio_priv(indio_dev);
+  int              ret;
 
   switch (mask) {
   case IIO_CHAN_INFO_RAW:
-    mutex_lock(&adc->lock);
-    *val = x8h7_adc_read_chan(adc, chan->channel);
-    mutex_unlock(&adc->lock);
-    if (*val == -1) {
-      return -EIO;
+    /* Recent enough value, also while streaming */
+    ret = x8h7_adc_cache_get(adc, chan->channel);
+    if (ret >= 0) {
+      *val = ret;
+      return IIO_VAL_INT;
     }
+    /*
+     * No adc->lock nor mlock, reads of several callers are in flight
+     * together. x8h7_adc_req_get refuses them while streaming, single
+     * reads would steal the H7 samples.
+     */
+    ret = x8h7_adc_read_chan(adc, chan->channel);
+    if (ret < 0) {
+      return ret;
+    }
+    *val = ret;
+    return IIO_VAL_INT;
+
+  case IIO_CHAN_INFO_SAMP_FREQ:
+    *val = adc->samp_freq;
     return IIO_VAL_INT;
 
   case IIO_CHAN_INFO_SCALE:
@@ -117,14 +623,405 @@ static int x8h7_adc_read_raw(struct iio_dev *indio_dev,
     return IIO_VAL_FRACTIONAL_LOG2;
 
   case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
-    return 0;
+    *val = adc->oversampling;
+    return IIO_VAL_INT;
+  }
+
+  return -EINVAL;
+}
+
+static int x8h7_adc_read_avail(struct iio_dev *indio_dev,
+                               struct iio_chan_spec const *chan,
+                               const int **vals, int *type, int *length,
+                               long mask)
+{
+  switch (mask) {
+  case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+    *vals   = x8h7_adc_oversampling_avail;
+    *type   = IIO_VAL_INT;
+    *length = ARRAY_SIZE(x8h7_adc_oversampling_avail);
+    return IIO_AVAIL_LIST;
   }
 
   return -EINVAL;
 }
 
+static int x8h7_adc_write_raw(struct iio_dev *indio_dev,
+                              struct iio_chan_spec const *chan,
+                              int val, int val2, long mask)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+  int              ret;
+  int              i;
+
+  switch (mask) {
+  case IIO_CHAN_INFO_SAMP_FREQ:
+    if ((val < 1) || (val > X8H7_ADC_SAMP_FREQ_MAX) || val2) {
+      return -EINVAL;
+    }
+    break;
+
+  case IIO_CHAN_INFO_OVERSAMPLING_RATIO:
+    for (i = 0; i < ARRAY_SIZE(x8h7_adc_oversampling_avail); i++) {
+      if (val == x8h7_adc_oversampling_avail[i]) {
+        break;
+      }
+    }
+    if ((i == ARRAY_SIZE(x8h7_adc_oversampling_avail)) || val2) {
+      return -EINVAL;
+    }
+    break;
+
+  default:
+    return -EINVAL;
+  }
+
+  /* Settings can not change while streaming */
+  ret = iio_device_claim_direct_mode(indio_dev);
+  if (ret) {
+    return ret;
+  }
+  mutex_lock(&adc->lock);
+  if (mask == IIO_CHAN_INFO_SAMP_FREQ) {
+    adc->samp_freq = val;
+  } else {
+    adc->oversampling = val;
+  }
+  x8h7_adc_configure(adc);
+  x8h7_adc_cache_clear(adc);
+  mutex_unlock(&adc->lock);
+  iio_device_release_direct_mode(indio_dev);
+
+  return 0;
+}
+
+static int x8h7_adc_read_event_config(struct iio_dev *indio_dev,
+                                      const struct iio_chan_spec *chan,
+                                      enum iio_event_type type,
+                                      enum iio_event_direction dir)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+  uint8_t          flag;
+
+  flag = (dir == IIO_EV_DIR_RISING) ? X8H7_ADC_THRESH_RISING :
+                                      X8H7_ADC_THRESH_FALLING;
+  return !!(adc->thresh[chan->channel].flags & flag);
+}
+
+static int x8h7_adc_write_event_config(struct iio_dev *indio_dev,
+                                       const struct iio_chan_spec *chan,
+                                       enum iio_event_type type,
+                                       enum iio_event_direction dir,
+                                       int state)
+{
+  struct x8h7_adc        *adc = iio_priv(indio_dev);
+  struct adcThreshPacket *th = &adc->thresh[chan->channel];
+  uint8_t                 flag;
+
+  flag = (dir == IIO_EV_DIR_RISING) ? X8H7_ADC_THRESH_RISING :
+                                      X8H7_ADC_THRESH_FALLING;
+  mutex_lock(&adc->lock);
+  if (state) {
+    th->flags |= flag;
+  } else {
+    th->flags &= ~flag;
+  }
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_THRESH_CFG,
+                     sizeof(*th), th);
+  mutex_unlock(&adc->lock);
+  return 0;
+}
+
+static int x8h7_adc_read_event_value(struct iio_dev *indio_dev,
+                                     const struct iio_chan_spec *chan,
+                                     enum iio_event_type type,
+                                     enum iio_event_direction dir,
+                                     enum iio_event_info info,
+                                     int *val, int *val2)
+{
+  struct x8h7_adc        *adc = iio_priv(indio_dev);
+  struct adcThreshPacket *th = &adc->thresh[chan->channel];
+
+  switch (info) {
+  case IIO_EV_INFO_VALUE:
+    *val = (dir == IIO_EV_DIR_RISING) ? th->rising : th->falling;
+    return IIO_VAL_INT;
+  case IIO_EV_INFO_HYSTERESIS:
+    *val = th->hysteresis;
+    return IIO_VAL_INT;
+  default:
+    return -EINVAL;
+  }
+}
+
+static int x8h7_adc_write_event_value(struct iio_dev *indio_dev,
+                                      const struct iio_chan_spec *chan,
+                                      enum iio_event_type type,
+                                      enum iio_event_direction dir,
+                                      enum iio_event_info info,
+                                      int val, int val2)
+{
+  struct x8h7_adc        *adc = iio_priv(indio_dev);
+  struct adcThreshPacket *th = &adc->thresh[chan->channel];
+
+  if ((val < 0) || (val > U16_MAX) || val2) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&adc->lock);
+  switch (info) {
+  case IIO_EV_INFO_VALUE:
+    if (dir == IIO_EV_DIR_RISING) {
+      th->rising = val;
+    } else {
+      th->falling = val;
+    }
+    break;
+  case IIO_EV_INFO_HYSTERESIS:
+    th->hysteresis = val;
+    break;
+  default:
+    mutex_unlock(&adc->lock);
+    return -EINVAL;
+  }
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_THRESH_CFG,
+                     sizeof(*th), th);
+  mutex_unlock(&adc->lock);
+  return 0;
+}
+
+/**
+ * Sampling time show, in ADC clock cycles
+ */
+static ssize_t sampling_time_cycles_show(struct device *dev,
+                                         struct device_attribute *attr,
+                                         char *buf)
+{
+  struct x8h7_adc *adc = iio_priv(dev_to_iio_dev(dev));
+
+  return sysfs_emit(buf, "%s\n", x8h7_adc_smp_cycles[adc->sample_time]);
+}
+
+/**
+ * Sampling time set, one of sampling_time_cycles_available
+ */
+static ssize_t sampling_time_cycles_store(struct device *dev,
+                                          struct device_attribute *attr,
+                                          const char *buf, size_t count)
+{
+  struct iio_dev   *indio_dev = dev_to_iio_dev(dev);
+  struct x8h7_adc  *adc = iio_priv(indio_dev);
+  int               ret;
+  int               i;
+
+  i = sysfs_match_string(x8h7_adc_smp_cycles, buf);
+  if (i < 0) {
+    return i;
+  }
+
+  ret = iio_device_claim_direct_mode(indio_dev);
+  if (ret) {
+    return ret;
+  }
+  mutex_lock(&adc->lock);
+  adc->sample_time = i;
+  x8h7_adc_configure(adc);
+  x8h7_adc_cache_clear(adc);
+  mutex_unlock(&adc->lock);
+  iio_device_release_direct_mode(indio_dev);
+
+  return count;
+}
+
+/**
+ * Sampling time choices, in ADC clock cycles
+ */
+static ssize_t sampling_time_cycles_available_show(struct device *dev,
+                                                   struct device_attribute *attr,
+                                                   char *buf)
+{
+  ssize_t len = 0;
+  int     i;
+
+  for (i = 0; i < ARRAY_SIZE(x8h7_adc_smp_cycles); i++) {
+    len += sysfs_emit_at(buf, len, "%s ", x8h7_adc_smp_cycles[i]);
+  }
+  buf[len - 1] = '\n';
+  return len;
+}
+
+/**
+ * Raw value of every channel from one round trip, space separated
+ */
+static ssize_t scan_raw_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+  struct iio_dev   *indio_dev = dev_to_iio_dev(dev);
+  struct x8h7_adc  *adc = iio_priv(indio_dev);
+  ssize_t           len = 0;
+  int               mask;
+  int               ch;
+
+  mask = iio_device_claim_direct_mode(indio_dev);
+  if (mask) {
+    return mask;
+  }
+  mutex_lock(&adc->lock);
+  mask = x8h7_adc_scan(adc, GENMASK(X8H7_ADC_NUM - 1, 0));
+  if (mask >= 0) {
+    for (ch = 0; ch < X8H7_ADC_NUM; ch++) {
+      if (mask & BIT(ch)) {
+        len += sysfs_emit_at(buf, len, "%u ", adc->scan_val[ch]);
+      } else {
+        len += sysfs_emit_at(buf, len, "- ");
+      }
+    }
+  }
+  mutex_unlock(&adc->lock);
+  iio_device_release_direct_mode(indio_dev);
+
+  if (mask < 0) {
+    return mask;
+  }
+  buf[len - 1] = '\n';
+  return len;
+}
+
+/**
+ * Cache max age show, 0 is disabled
+ */
+static ssize_t cache_max_age_ms_show(struct device *dev,
+                                     struct device_attribute *attr, char *buf)
+{
+  struct x8h7_adc *adc = iio_priv(dev_to_iio_dev(dev));
+
+  return sysfs_emit(buf, "%u\n", adc->cache_max_age_ms);
+}
+
+/**
+ * Cache max age set, raw reads within this time return the last value
+ * without bus traffic
+ */
+static ssize_t cache_max_age_ms_store(struct device *dev,
+                                      struct device_attribute *attr,
+                                      const char *buf, size_t count)
+{
+  struct x8h7_adc *adc = iio_priv(dev_to_iio_dev(dev));
+  unsigned int     val;
+
+  if (kstrtouint(buf, 0, &val) || (val > X8H7_ADC_CACHE_MAX_AGE_MS_MAX)) {
+    return -EINVAL;
+  }
+
+  spin_lock(&adc->req_lock);
+  adc->cache_max_age_ms = val;
+  spin_unlock(&adc->req_lock);
+
+  return count;
+}
+
+static DEVICE_ATTR_RO(scan_raw);
+static DEVICE_ATTR_RW(cache_max_age_ms);
+static DEVICE_ATTR_RW(sampling_time_cycles);
+static DEVICE_ATTR_RO(sampling_time_cycles_available);
+
+static struct attribute *x8h7_adc_attrs[] = {
+  &dev_attr_scan_raw.attr,
+  &dev_attr_cache_max_age_ms.attr,
+  &dev_attr_sampling_time_cycles.attr,
+  &dev_attr_sampling_time_cycles_available.attr,
+  NULL,
+};
+
+static const struct attribute_group x8h7_adc_attr_group = {
+  .attrs = x8h7_adc_attrs,
+};
+
 static const struct iio_info x8h7_adc_info = {
-  .read_raw = x8h7_adc_read_raw,
+  .read_raw   = x8h7_adc_read_raw,
+  .read_avail = x8h7_adc_read_avail,
+  .write_raw  = x8h7_adc_write_raw,
+  .read_event_config  = x8h7_adc_read_event_config,
+  .write_event_config = x8h7_adc_write_event_config,
+  .read_event_value   = x8h7_adc_read_event_value,
+  .write_event_value  = x8h7_adc_write_event_value,
+  .attrs      = &x8h7_adc_attr_group,
+};
+
+/**
+ * Refuse new single reads and let those in flight finish
+ */
+static int x8h7_adc_buffer_preenable(struct iio_dev *indio_dev)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+  int              ret;
+
+  spin_lock(&adc->req_lock);
+  adc->streaming = true;
+  spin_unlock(&adc->req_lock);
+
+  ret = wait_event_interruptible(adc->req_wait, READ_ONCE(adc->req_cnt) == 0);
+  if (ret) {
+    spin_lock(&adc->req_lock);
+    adc->streaming = false;
+    spin_unlock(&adc->req_lock);
+  }
+  return ret;
+}
+
+/**
+ * Start H7 continuous sampling of the enabled channels
+ */
+static int x8h7_adc_buffer_postenable(struct iio_dev *indio_dev)
+{
+  struct x8h7_adc        *adc = iio_priv(indio_dev);
+  struct adcStreamPacket  pkt;
+
+  pkt.mask    = *indio_dev->active_scan_mask & GENMASK(X8H7_ADC_NUM - 1, 0);
+  pkt.freq_hz = adc->samp_freq;
+  DBG_PRINT("stream start mask %02X freq %d\n", pkt.mask, pkt.freq_hz);
+
+  mutex_lock(&adc->lock);
+  /* H7 timer may have been restarted, resync */
+  adc->ts.valid = false;
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_STREAM_START,
+                     sizeof(pkt), &pkt);
+  mutex_unlock(&adc->lock);
+  return 0;
+}
+
+/**
+ * Stop H7 continuous sampling
+ */
+static int x8h7_adc_buffer_predisable(struct iio_dev *indio_dev)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+
+  DBG_PRINT("stream stop\n");
+  mutex_lock(&adc->lock);
+  x8h7_pkt_send_sync(X8H7_ADC_PERIPH, X8H7_ADC_OC_STREAM_STOP, 0, NULL);
+  mutex_unlock(&adc->lock);
+  return 0;
+}
+
+/**
+ * H7 stopped streaming, single reads allowed again
+ */
+static int x8h7_adc_buffer_postdisable(struct iio_dev *indio_dev)
+{
+  struct x8h7_adc *adc = iio_priv(indio_dev);
+
+  spin_lock(&adc->req_lock);
+  adc->streaming = false;
+  spin_unlock(&adc->req_lock);
+  return 0;
+}
+
+static const struct iio_buffer_setup_ops x8h7_adc_buffer_ops = {
+  .preenable   = x8h7_adc_buffer_preenable,
+  .postenable  = x8h7_adc_buffer_postenable,
+  .predisable  = x8h7_adc_buffer_predisable,
+  .postdisable = x8h7_adc_buffer_postdisable,
 };
 
 static int x8h7_adc_probe(struct platform_device *pdev)
@@ -141,15 +1038,19 @@ static int x8h7_adc_probe(struct platform_device *pdev)
 
   platform_set_drvdata(pdev, indio_dev);
   adc = iio_priv(indio_dev);
-  adc->dev = &pdev->dev;
+  adc->dev          = &pdev->dev;
+  adc->indio_dev    = indio_dev;
+  adc->samp_freq    = X8H7_ADC_SAMP_FREQ_DEF;
+  adc->oversampling = 1;
+  adc->sample_time  = X8H7_ADC_SMP_TIME_DEF;
   mutex_init(&adc->lock);
-#if 0
-  init_waitqueue_head(&adc->wait);
-#else
+  spin_lock_init(&adc->req_lock);
+  init_waitqueue_head(&adc->req_wait);
+  init_waitqueue_head(&adc->scan_wait);
   for (i=0; i<X8H7_ADC_NUM; i++) {
-    init_waitqueue_head(&adc->val[i].wait);
+    adc->thresh[i].ch     = i;
+    adc->thresh[i].rising = U16_MAX;
   }
-#endif
   indio_dev->name         = dev_name(&pdev->dev);
   indio_dev->dev.parent   = &pdev->dev;
   indio_dev->info         = &x8h7_adc_info;
@@ -157,6 +1058,18 @@ static int x8h7_adc_probe(struct platform_device *pdev)
   indio_dev->channels     = x8h7_adc_iio_channels;
   indio_dev->num_channels = ARRAY_SIZE(x8h7_adc_iio_channels);
 
+  ret = devm_iio_kfifo_buffer_setup(&pdev->dev, indio_dev,
+                                    &x8h7_adc_buffer_ops);
+  if (ret) {
+    dev_err(&pdev->dev, "unable to setup buffer\n");
+    return ret;
+  }
+
+  /* H7 keeps settings across host reboots, start from known defaults */
+  mutex_lock(&adc->lock);
+  x8h7_adc_configure(adc);
+  mutex_unlock(&adc->lock);
+
   ret = iio_device_register(indio_dev);
   if (ret) {
     dev_err(&pdev->dev, "unable to register device\n");
@@ -170,6 +1083,11 @@ static int x8h7_adc_probe(struct platform_device *pdev)
 
 static int x8h7_adc_remove(struct platform_device *pdev)
 {
+  struct iio_dev *indio_dev = platform_get_drvdata(pdev);
+
+  /* No more replies nor events into a device going away */
+  x8h7_hook_set(X8H7_ADC_PERIPH, NULL, NULL);
+  iio_device_unregister(indio_dev);
   return 0;
 }
 
@@ -25,6 +25,9 @@
 #include <linux/uaccess.h>
 #include <linux/regulator/consumer.h>
 #include <linux/wait.h>
+#include <linux/hash.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
 
 #include "x8h7.h"
 
@@ -57,8 +60,12 @@ static const struct can_bittiming_const x8h7_can_bittiming_const = {
   .brp_inc   =   1,
 };
 
-static void x8h7_can_tx_work_handler(struct work_struct *ws);
+static int x8h7_can_hw_restore_filters(struct x8h7_can_priv *priv);
+static int x8h7_can_hw_setup(struct x8h7_can_priv *priv);
+static int x8h7_can_hw_stop(struct x8h7_can_priv *priv);
 static void x8h7_can_error_skb(struct net_device *net, int can_id, int data1);
+static void x8h7_can_tx_flush(struct x8h7_can_priv *priv);
+static void x8h7_can_tx_dispatch(struct x8h7_can_priv *priv);
 
 /**
  */
@@ -73,6 +80,268 @@ static void x8h7_can_frame_to_tx_obj(struct can_frame const *frame, union x8h7_c
   memcpy(x8h7_can_msg->field.data, frame->data, x8h7_can_msg->field.len);
 }
 
+/**
+ * Bits on the wire of a data frame, including worst case bit stuffing
+ * and interframe space.
+ */
+static uint32_t x8h7_can_frame_bits(canid_t const can_id, uint8_t const len)
+{
+  if (can_id & CAN_EFF_FLAG)
+    return 8 * len + 67 + (54 + 8 * len - 1) / 4;
+  else
+    return 8 * len + 47 + (34 + 8 * len - 1) / 4;
+}
+
+/**
+ * Move the bus load ring to the current time slot, clearing skipped slots.
+ * Called with stats lock held.
+ */
+static void x8h7_can_stats_advance(struct x8h7_can_stats *stats)
+{
+  unsigned long slot_len = msecs_to_jiffies(X8H7_CAN_STATS_SLOT_MS);
+  unsigned long elapsed;
+
+  elapsed = (jiffies - stats->slot_start) / slot_len;
+  if (elapsed == 0) {
+    return;
+  }
+  if (elapsed >= X8H7_CAN_STATS_SLOT_NUM) {
+    memset(stats->bits, 0, sizeof(stats->bits));
+    stats->slot_start = jiffies;
+    return;
+  }
+  stats->slot_start += elapsed * slot_len;
+  while (elapsed--) {
+    stats->slot = (stats->slot + 1) % X8H7_CAN_STATS_SLOT_NUM;
+    stats->bits[stats->slot] = 0;
+  }
+}
+
+/**
+ * Account a frame seen on the bus, O(1) with bounded probing.
+ */
+static void x8h7_can_stats_frame(struct x8h7_can_priv *priv,
+                                 canid_t const can_id, uint8_t const len,
+                                 bool const tx)
+{
+  struct x8h7_can_stats    *stats = &priv->stats;
+  struct x8h7_can_id_stats *entry;
+  unsigned long             flags;
+  uint32_t                  h;
+  int                       i;
+
+  if (!READ_ONCE(stats->enable)) {
+    return;
+  }
+
+  spin_lock_irqsave(&stats->lock, flags);
+  x8h7_can_stats_advance(stats);
+  stats->bits[stats->slot] += x8h7_can_frame_bits(can_id, len);
+
+  h = hash_32(can_id, X8H7_CAN_STATS_ID_BITS);
+  for (i = 0; i < X8H7_CAN_STATS_ID_PROBE; i++) {
+    entry = &stats->id[(h + i) % X8H7_CAN_STATS_ID_NUM];
+    if ((entry->rx == 0) && (entry->tx == 0)) {
+      entry->can_id = can_id;
+      stats->id_used++;
+      break;
+    }
+    if (entry->can_id == can_id) {
+      break;
+    }
+  }
+  if (i < X8H7_CAN_STATS_ID_PROBE) {
+    if (tx) {
+      entry->tx++;
+    } else {
+      entry->rx++;
+    }
+  } else {
+    stats->id_untracked++;
+  }
+  spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+/**
+ * Account an overflow signaled by the H7, counted even when stats are off
+ */
+static void x8h7_can_stats_overflow(struct x8h7_can_priv *priv, bool const tx)
+{
+  struct x8h7_can_stats *stats = &priv->stats;
+  unsigned long          flags;
+
+  spin_lock_irqsave(&stats->lock, flags);
+  if (tx) {
+    stats->tx_overflow++;
+  } else {
+    stats->rx_overflow++;
+  }
+  spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+/**
+ */
+static void x8h7_can_stats_reset(struct x8h7_can_stats *stats)
+{
+  unsigned long flags;
+
+  spin_lock_irqsave(&stats->lock, flags);
+  memset(stats->bits, 0, sizeof(stats->bits));
+  memset(stats->id, 0, sizeof(stats->id));
+  stats->slot_start   = jiffies;
+  stats->slot         = 0;
+  stats->id_used      = 0;
+  stats->id_untracked = 0;
+  stats->rx_overflow  = 0;
+  stats->tx_overflow  = 0;
+  spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+/**
+ */
+static int x8h7_can_stats_cmp(const void *a, const void *b)
+{
+  const struct x8h7_can_id_stats *ea = a;
+  const struct x8h7_can_id_stats *eb = b;
+  uint64_t                        ca = (uint64_t)ea->rx + ea->tx;
+  uint64_t                        cb = (uint64_t)eb->rx + eb->tx;
+
+  if (ca == cb)
+    return 0;
+  return ca < cb ? 1 : -1;
+}
+
+/**
+ * Bus load in hundredths of percent over the last num slots
+ */
+static uint32_t x8h7_can_stats_load(struct x8h7_can_priv *priv,
+                                    uint32_t const *bits, int const slot,
+                                    int const num)
+{
+  uint64_t sum;
+  uint64_t capacity;
+  int      i;
+
+  capacity = (uint64_t)priv->can.bittiming.bitrate * num * X8H7_CAN_STATS_SLOT_MS / 1000;
+  if (!capacity) {
+    return 0;
+  }
+  sum = 0;
+  for (i = 0; i < num; i++) {
+    sum += bits[(slot + X8H7_CAN_STATS_SLOT_NUM - i) % X8H7_CAN_STATS_SLOT_NUM];
+  }
+  return div64_u64(sum * 10000, capacity);
+}
+
+/**
+ */
+static int x8h7_can_stats_show(struct seq_file *m, void *v)
+{
+  struct x8h7_can_priv     *priv = m->private;
+  struct x8h7_can_stats    *stats = &priv->stats;
+  struct x8h7_can_id_stats *id;
+  uint32_t                 *bits;
+  unsigned long             flags;
+  uint32_t                  load_1s;
+  uint32_t                  load_10s;
+  int                       slot;
+  int                       num;
+  int                       i;
+
+  id = kmalloc(sizeof(stats->id), GFP_KERNEL);
+  bits = kmalloc(sizeof(stats->bits), GFP_KERNEL);
+  if (!id || !bits) {
+    kfree(id);
+    kfree(bits);
+    return -ENOMEM;
+  }
+
+  spin_lock_irqsave(&stats->lock, flags);
+  x8h7_can_stats_advance(stats);
+  memcpy(id, stats->id, sizeof(stats->id));
+  memcpy(bits, stats->bits, sizeof(stats->bits));
+  slot = stats->slot;
+  seq_printf(m,
+             "enable         %d\n"
+             "bitrate        %u\n"
+             "rx overflow    %u\n"
+             "tx overflow    %u\n"
+             "ids tracked    %u\n"
+             "untracked      %llu\n",
+             stats->enable,
+             priv->can.bittiming.bitrate,
+             stats->rx_overflow,
+             stats->tx_overflow,
+             stats->id_used,
+             stats->id_untracked);
+  spin_unlock_irqrestore(&stats->lock, flags);
+
+  load_1s  = x8h7_can_stats_load(priv, bits, slot, 1000 / X8H7_CAN_STATS_SLOT_MS);
+  load_10s = x8h7_can_stats_load(priv, bits, slot, X8H7_CAN_STATS_SLOT_NUM);
+  seq_printf(m,
+             "bus load 1s    %u.%02u %%\n"
+             "bus load 10s   %u.%02u %%\n",
+             load_1s / 100, load_1s % 100,
+             load_10s / 100, load_10s % 100);
+
+  /* Top talkers */
+  sort(id, X8H7_CAN_STATS_ID_NUM, sizeof(*id), x8h7_can_stats_cmp, NULL);
+  num = min(X8H7_CAN_STATS_TOP, X8H7_CAN_STATS_ID_NUM);
+  seq_puts(m, "id         rx         tx\n");
+  for (i = 0; i < num && (id[i].rx || id[i].tx); i++) {
+    seq_printf(m, "%08X   %-10u %-10u\n",
+               id[i].can_id, id[i].rx, id[i].tx);
+  }
+
+  kfree(id);
+  kfree(bits);
+  return 0;
+}
+
+/**
+ */
+static int x8h7_can_stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, x8h7_can_stats_show, inode->i_private);
+}
+
+/**
+ * Any write resets the statistics
+ */
+static ssize_t x8h7_can_stats_write(struct file *file, const char __user *buf,
+                                    size_t count, loff_t *ppos)
+{
+  struct x8h7_can_priv *priv = ((struct seq_file *)file->private_data)->private;
+
+  x8h7_can_stats_reset(&priv->stats);
+  return count;
+}
+
+static const struct file_operations x8h7_can_stats_fops = {
+  .owner   = THIS_MODULE,
+  .open    = x8h7_can_stats_open,
+  .read    = seq_read,
+  .write   = x8h7_can_stats_write,
+  .llseek  = seq_lseek,
+  .release = single_release,
+};
+
+/**
+ * Statistics engine lives in debugfs x8h7_<ifname>/, disabled by default
+ */
+static void x8h7_can_stats_init(struct x8h7_can_priv *priv)
+{
+  char name[IFNAMSIZ + 8];
+
+  spin_lock_init(&priv->stats.lock);
+  x8h7_can_stats_reset(&priv->stats);
+
+  snprintf(name, sizeof(name), "x8h7_%s", priv->net->name);
+  priv->stats.dir = debugfs_create_dir(name, NULL);
+  debugfs_create_bool("enable", 0644, priv->stats.dir, &priv->stats.enable);
+  debugfs_create_file("stats", 0644, priv->stats.dir, priv, &x8h7_can_stats_fops);
+}
+
 /**
  */
 static char* can_sts(enum can_state sts)
@@ -89,12 +358,105 @@ static char* can_sts(enum can_state sts)
 }
 
 /**
+ * Compute the new controller state from error flags and counters
+ * and notify the CAN core on any transition.
+ */
+static void x8h7_can_state(struct x8h7_can_priv *priv, u8 eflag)
+{
+  struct net_device  *net = priv->net;
+  struct sk_buff     *skb;
+  struct can_frame   *frame;
+  enum can_state      tx_state;
+  enum can_state      rx_state;
+
+  if (eflag & X8H7_CAN_STS_FLG_TX_BO) {
+    tx_state = CAN_STATE_BUS_OFF;
+  } else if ((eflag & X8H7_CAN_STS_FLG_TX_EP) ||
+             (priv->bec.txerr >= X8H7_CAN_ERR_PASSIVE_LIMIT)) {
+    tx_state = CAN_STATE_ERROR_PASSIVE;
+  } else if ((eflag & X8H7_CAN_STS_FLG_TX_WAR) ||
+             (priv->bec.txerr >= X8H7_CAN_ERR_WARNING_LIMIT)) {
+    tx_state = CAN_STATE_ERROR_WARNING;
+  } else {
+    tx_state = CAN_STATE_ERROR_ACTIVE;
+  }
+
+  if ((eflag & X8H7_CAN_STS_FLG_RX_EP) ||
+      (priv->bec.rxerr >= X8H7_CAN_ERR_PASSIVE_LIMIT)) {
+    rx_state = CAN_STATE_ERROR_PASSIVE;
+  } else if ((eflag & X8H7_CAN_STS_FLG_RX_WAR) ||
+             (priv->bec.rxerr >= X8H7_CAN_ERR_WARNING_LIMIT)) {
+    rx_state = CAN_STATE_ERROR_WARNING;
+  } else {
+    rx_state = CAN_STATE_ERROR_ACTIVE;
+  }
+
+  /* Generic warning flag without direction: blame the larger counter */
+  if ((eflag & X8H7_CAN_STS_FLG_EWARN) &&
+      (max(tx_state, rx_state) < CAN_STATE_ERROR_WARNING)) {
+    if (priv->bec.txerr >= priv->bec.rxerr) {
+      tx_state = CAN_STATE_ERROR_WARNING;
+    } else {
+      rx_state = CAN_STATE_ERROR_WARNING;
+    }
+  }
+
+  if (max(tx_state, rx_state) == priv->can.state) {
+    return;
+  }
+
+  skb = alloc_can_err_skb(net, &frame);
+  can_change_state(net, skb ? frame : NULL, tx_state, rx_state);
+  DBG_CAN_STATE(net->name, priv->can.state);
+  if (skb) {
+    frame->data[6] = priv->bec.txerr;
+    frame->data[7] = priv->bec.rxerr;
+    netif_rx(skb);
+  } else {
+    netdev_err(net, "cannot allocate error skb\n");
+  }
+
+  if (priv->can.state == CAN_STATE_BUS_OFF) {
+    /* Frames in flight will never complete, H7 needs a restart */
+    netif_stop_queue(net);
+    x8h7_can_tx_flush(priv);
+    can_bus_off(net);
+  }
+}
+
+/**
+ * Release the H7 TX buffer a frame was sent from and account the frame.
+ * Called with tx_lock held.
+ */
+static void x8h7_can_tx_done(struct x8h7_can_priv *priv, int mb)
+{
+  struct net_device  *net = priv->net;
+
+  lockdep_assert_held(&priv->tx_lock);
+
+  if ((mb >= X8H7_TX_MB_NUM) || !test_bit(mb, &priv->tx_mb_used)) {
+    DBG_ERROR("TX complete for unknown buffer %d\n", mb);
+    return;
+  }
+  net->stats.tx_packets++;
+  net->stats.tx_bytes += priv->tx_mb_len[mb];
+  x8h7_can_stats_frame(priv, priv->tx_mb_id[mb], priv->tx_mb_len[mb], true);
+  can_get_echo_skb(net, mb, NULL);
+  clear_bit(mb, &priv->tx_mb_used);
+  priv->tx_mb_cnt--;
+}
+
+/**
+ * tag/tag_num are the TX buffer tags of the completed frames echoed by
+ * the H7, older firmware sends none.
  */
-static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
+static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag,
+                            const u8 *tag, int tag_num)
 {
   struct net_device  *net = priv->net;
   int                 can_id = 0;
   int                 data1 = 0;
+  int                 i;
 
   //DBG_PRINT("\n");
 
@@ -105,6 +467,7 @@ static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
     {
       net->stats.rx_over_errors++;
       net->stats.rx_errors++;
+      x8h7_can_stats_overflow(priv, false);
       can_id |= CAN_ERR_CRTL;
       data1 |= CAN_ERR_CRTL_RX_OVERFLOW;
       x8h7_can_error_skb(net, can_id, data1);
@@ -113,19 +476,39 @@ static void x8h7_can_status(struct x8h7_can_priv *priv, u8 intf, u8 eflag)
     {
       net->stats.tx_fifo_errors++;
       net->stats.tx_errors++;
+      x8h7_can_stats_overflow(priv, true);
       can_id |= CAN_ERR_CRTL;
       data1 |= CAN_ERR_CRTL_TX_OVERFLOW;
       x8h7_can_error_skb(net, can_id, data1);
     }
+
+    x8h7_can_state(priv, eflag);
   }
 
   if (intf & X8H7_CAN_STS_INT_TX_COMPLETE) {
     DBG_PRINT("TX COMPLETE");
-    net->stats.tx_packets++;
-    net->stats.tx_bytes += priv->tx_len;
-    priv->tx_len = 0;
-    can_get_echo_skb(net, 0, NULL);
-    netif_wake_queue(net);
+    spin_lock_bh(&priv->tx_lock);
+    if (tag_num > 0) {
+      /* Tagged firmware, completions may come in any order */
+      priv->tx_mb_max = X8H7_TX_MB_NUM;
+      for (i = 0; i < tag_num; i++) {
+        x8h7_can_tx_done(priv, tag[i]);
+      }
+    } else if (priv->tx_mb_max == 1) {
+      /* Untagged firmware, the only frame in flight is done */
+      if (priv->tx_mb_cnt) {
+        x8h7_can_tx_done(priv, __ffs(priv->tx_mb_used));
+      }
+    } else {
+      DBG_ERROR("untagged TX complete with %d frames in flight\n", priv->tx_mb_cnt);
+    }
+    /* A TX buffer is free, dispatch the next pending frame */
+    x8h7_can_tx_dispatch(priv);
+    if ((priv->tx_queue_len < X8H7_TX_FIFO_SIZE) &&
+        (priv->can.state != CAN_STATE_BUS_OFF)) {
+      netif_wake_queue(net);
+    }
+    spin_unlock_bh(&priv->tx_lock);
   }
 
   if (intf & X8H7_CAN_STS_INT_TX_ABORT_COMPLETE)
@@ -179,12 +562,26 @@ static void x8h7_can_hook(void *arg, x8h7_pkt_t *pkt)
 
       priv->net->stats.rx_packets++;
       priv->net->stats.rx_bytes += frame->can_dlc;
+      x8h7_can_stats_frame(priv, frame->can_id, frame->can_dlc, false);
       netif_rx(skb);
     }
     break;
   case X8H7_CAN_OC_STS:
+    if (pkt->size < X8H7_CAN_STS_SIZE) {
+      DBG_ERROR("received status is too short (%d)\n", pkt->size);
+      return;
+    }
     DBG_PRINT("received status %02X %02X\n", pkt->data[0], pkt->data[1]);
-    x8h7_can_status(priv, pkt->data[0], pkt->data[1]);
+    /* Newer H7 firmware appends TEC/REC and the completed TX tags */
+    if (pkt->size >= X8H7_CAN_STS_BEC_SIZE) {
+      priv->bec.txerr = pkt->data[2];
+      priv->bec.rxerr = pkt->data[3];
+      x8h7_can_status(priv, pkt->data[0], pkt->data[1],
+                      pkt->data + X8H7_CAN_STS_BEC_SIZE,
+                      pkt->size - X8H7_CAN_STS_BEC_SIZE);
+    } else {
+      x8h7_can_status(priv, pkt->data[0], pkt->data[1], NULL, 0);
+    }
     break;
   }
 }
@@ -196,20 +593,59 @@ static void x8h7_can_hook(void *arg, x8h7_pkt_t *pkt)
 static int x8h7_can_restart(struct net_device *net)
 {
   struct x8h7_can_priv *priv = netdev_priv(net);
-  int err = 0;
 
   DBG_PRINT("\n");
 
-  /* @TODO: notify external hw? */
-  DBG_PRINT("@TODO: notify external hw?\n");
+  /* H7 re-initialization is done in x8h7_can_restart_work_handler */
+  schedule_work(&priv->restart_work);
+
+  return 0;
+}
+
+/**
+ * Bring the H7 CAN peripheral out of bus-off by re-initializing it
+ */
+static void x8h7_can_restart_work_handler(struct work_struct *ws)
+{
+  struct x8h7_can_priv *priv = container_of(ws, struct x8h7_can_priv, restart_work);
+  struct net_device    *net = priv->net;
+
+  DBG_PRINT("\n");
+
+  x8h7_can_hw_stop(priv);
+  x8h7_can_hw_setup(priv);
+  x8h7_can_hw_restore_filters(priv);
 
   /* finally MUST update can state */
-	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+  priv->bec.txerr = 0;
+  priv->bec.rxerr = 0;
+  priv->can.state = CAN_STATE_ERROR_ACTIVE;
 
   /* netdev queue can be awaken now */
-	netif_wake_queue(net);
+  netif_wake_queue(net);
+}
 
-  return err;
+/**
+ * Push the transport queue out, which frees room for async packets,
+ * then dispatch pending frames again.
+ */
+static void x8h7_can_tx_retry_work_handler(struct work_struct *ws)
+{
+  struct x8h7_can_priv *priv = container_of(ws, struct x8h7_can_priv, tx_retry_work);
+  struct net_device    *net = priv->net;
+
+  DBG_PRINT("\n");
+
+  x8h7_pkt_send_now();
+
+  spin_lock_bh(&priv->tx_lock);
+  x8h7_can_tx_dispatch(priv);
+  if (netif_running(net) &&
+      (priv->tx_queue_len < X8H7_TX_FIFO_SIZE) &&
+      (priv->can.state != CAN_STATE_BUS_OFF)) {
+    netif_wake_queue(net);
+  }
+  spin_unlock_bh(&priv->tx_lock);
 }
 
 /**
@@ -301,36 +737,35 @@ static int x8h7_can_open(struct net_device *net)
     return ret;
   }
 
-  priv->tx_len  = 0;
-
-  priv->wq = alloc_workqueue("x8h7_can_wq", WQ_FREEZABLE | WQ_MEM_RECLAIM, 0);
-  if (!priv->wq) {
-    ret = -ENOMEM;
-    goto out_clean;
-  }
-  INIT_WORK(&priv->work, x8h7_can_tx_work_handler);
+  priv->tx_queue_len = 0;
+  priv->tx_mb_used   = 0;
+  priv->tx_mb_cnt    = 0;
+  priv->bec.txerr = 0;
+  priv->bec.rxerr = 0;
 
   mutex_init(&priv->lock);
 
   ret = x8h7_can_hw_stop(priv);
   if (ret) {
-    goto out_free_wq;
+    goto out_clean;
   }
   ret = x8h7_can_hw_setup(priv);
   if (ret) {
-    goto out_free_wq;
+    goto out_clean;
   }
   ret = x8h7_can_set_normal_mode(priv);
   if (ret) {
-    goto out_free_wq;
+    goto out_clean;
+  }
+  ret = x8h7_can_hw_restore_filters(priv);
+  if (ret) {
+    goto out_clean;
   }
 
   netif_start_queue(net);
 
   return 0;
 
-out_free_wq:
-  destroy_workqueue(priv->wq);
 out_clean:
   x8h7_hook_set(priv->periph, NULL, NULL);
   close_candev(net);
@@ -348,7 +783,10 @@ static int x8h7_can_stop(struct net_device *net)
 
   /* Notify upper level */
   netif_stop_queue(net);
+  cancel_work_sync(&priv->tx_retry_work);
+  x8h7_can_tx_flush(priv);
   close_candev(net);
+  cancel_work_sync(&priv->restart_work);
 
   /* Notify ext. hw to stop can peripheral */
   x8h7_can_hw_stop(priv);
@@ -356,8 +794,6 @@ static int x8h7_can_stop(struct net_device *net)
   /* Free priv. resources */
   mutex_lock(&priv->lock);
   x8h7_hook_set(priv->periph, NULL, NULL);
-  destroy_workqueue(priv->wq);
-  priv->wq = NULL;
 
   priv->can.state = CAN_STATE_STOPPED;
   mutex_unlock(&priv->lock);
@@ -365,13 +801,115 @@ static int x8h7_can_stop(struct net_device *net)
   return 0;
 }
 
+/**
+ * Arbitration priority of a CAN id, lower value wins: the 11 base id bits
+ * first, then standard before extended frames, then the extended id bits.
+ */
+static uint32_t x8h7_can_tx_prio(canid_t const can_id)
+{
+  if (can_id & CAN_EFF_FLAG)
+    return (((can_id & CAN_EFF_MASK) >> 18) << 19) | BIT(18) | (can_id & 0x3FFFF);
+  else
+    return  ((can_id & CAN_SFF_MASK)        << 19);
+}
+
+/**
+ * Drop all pending and in-flight frames.
+ */
+static void x8h7_can_tx_flush(struct x8h7_can_priv *priv)
+{
+  struct net_device *net = priv->net;
+  int                i;
+
+  spin_lock_bh(&priv->tx_lock);
+  for (i = 0; i < priv->tx_queue_len; i++) {
+    dev_kfree_skb_any(priv->tx_queue[i].skb);
+    net->stats.tx_dropped++;
+  }
+  priv->tx_queue_len = 0;
+  for_each_set_bit(i, &priv->tx_mb_used, X8H7_TX_MB_NUM) {
+    can_free_echo_skb(net, i, NULL);
+    net->stats.tx_dropped++;
+  }
+  priv->tx_mb_used = 0;
+  priv->tx_mb_cnt  = 0;
+  spin_unlock_bh(&priv->tx_lock);
+}
+
+/**
+ * Move pending frames into free H7 TX buffers, highest priority first.
+ * Frames with the same priority leave in submission order. Frames are
+ * queued straight to the SPI transport without sleeping, so this runs
+ * from ndo_start_xmit and from the TX complete status.
+ * Called with tx_lock held.
+ */
+static void x8h7_can_tx_dispatch(struct x8h7_can_priv *priv)
+{
+  struct net_device           *net = priv->net;
+  struct x8h7_can_tx_entry    *entry;
+  union x8h7_can_frame_message x8h7_can_msg;
+  int                          mb;
+  int                          i;
+
+  lockdep_assert_held(&priv->tx_lock);
+
+  while ((priv->tx_queue_len > 0) && (priv->tx_mb_cnt < priv->tx_mb_max)) {
+    entry = &priv->tx_queue[0];
+    for (i = 1; i < priv->tx_queue_len; i++) {
+      if ((priv->tx_queue[i].prio < entry->prio) ||
+          ((priv->tx_queue[i].prio == entry->prio) &&
+           ((int32_t)(priv->tx_queue[i].seq - entry->seq) < 0))) {
+        entry = &priv->tx_queue[i];
+      }
+    }
+
+    x8h7_can_frame_to_tx_obj((struct can_frame *)entry->skb->data, &x8h7_can_msg);
+    mb = ffz(priv->tx_mb_used);
+    x8h7_can_msg.buf[X8H7_CAN_HEADER_SIZE + x8h7_can_msg.field.len] = mb;
+
+#ifdef DEBUG
+    {
+      char  data_str[X8H7_CAN_FRAME_MAX_DATA_LEN * 4];
+      int   len;
+
+      len = 0;
+      for (i = 0; (i < x8h7_can_msg.field.len) && (len < sizeof(data_str)); i++)
+        len += snprintf(data_str + len, sizeof(data_str) - len, " %02X", x8h7_can_msg.field.data[i]);
+      DBG_PRINT("Send CAN frame to H7: id = %08X, len = %d, data = [%s ]\n", x8h7_can_msg.field.id, x8h7_can_msg.field.len, data_str);
+    }
+#endif
+
+    /* Send 4-Byte ID, 1-Byte Length, the required number of data bytes
+     * and the TX buffer tag echoed back on TX complete.
+     */
+    if (x8h7_pkt_send_async(priv->periph,
+                            X8H7_CAN_OC_SEND,
+                            X8H7_CAN_HEADER_SIZE + x8h7_can_msg.field.len + X8H7_CAN_TX_TAG_SIZE,
+                            x8h7_can_msg.buf) < 0) {
+      /* Transport queue full, x8h7_can_tx_retry_work_handler retries */
+      DBG_ERROR("transport queue full\n");
+      schedule_work(&priv->tx_retry_work);
+      break;
+    }
+
+    set_bit(mb, &priv->tx_mb_used);
+    priv->tx_mb_len[mb] = x8h7_can_msg.field.len;
+    priv->tx_mb_id[mb]  = x8h7_can_msg.field.id;
+    can_put_echo_skb(entry->skb, net, mb, 0);
+    priv->tx_mb_cnt++;
+
+    /* Keep the queue compact, order is given by prio/seq */
+    *entry = priv->tx_queue[--priv->tx_queue_len];
+  }
+}
+
 /**
  */
 static netdev_tx_t x8h7_can_start_xmit(struct sk_buff *skb,
                                        struct net_device *net)
 {
   struct x8h7_can_priv        *priv = netdev_priv(net);
-  const struct device         *dev = priv->dev;
+  struct x8h7_can_tx_entry    *entry;
   struct can_frame            *frame;
 
   DBG_PRINT("\n");
@@ -379,39 +917,22 @@ static netdev_tx_t x8h7_can_start_xmit(struct sk_buff *skb,
   if (can_dropped_invalid_skb(net, skb))
     return NETDEV_TX_OK;
 
-  netif_stop_queue(net);
-
   frame = (struct can_frame *)skb->data;
-  x8h7_can_frame_to_tx_obj(frame, &priv->tx_frame);
-  can_put_echo_skb(skb, net, 0, 0);
-  queue_work(priv->wq, &priv->work);
-
-  return NETDEV_TX_OK;
-}
-
-/**
- */
-static void x8h7_can_tx_work_handler(struct work_struct *ws)
-{
-  struct x8h7_can_priv *priv = container_of(ws, struct x8h7_can_priv, work);
 
-#ifdef DEBUG
-  char  data_str[X8H7_CAN_FRAME_MAX_DATA_LEN * 4];
-  int   i;
-  int   len;
-
-  i = 0; len = 0;
-  for (i = 0; (i < priv->tx_frame.field.len) && (len < sizeof(data_str)); i++)
-    len += snprintf(data_str + len, sizeof(data_str) - len, " %02X", priv->tx_frame.field.data[i]);
-  DBG_PRINT("Send CAN frame to H7: id = %08X, len = %d, data = [%s ]\n", priv->tx_frame.field.id, priv->tx_frame.field.len, data_str);
-#endif
+  spin_lock(&priv->tx_lock);
+  entry = &priv->tx_queue[priv->tx_queue_len++];
+  entry->skb  = skb;
+  entry->prio = x8h7_can_tx_prio(frame->can_id);
+  entry->seq  = priv->tx_seq++;
 
-  priv->tx_len = priv->tx_frame.field.len;
+  x8h7_can_tx_dispatch(priv);
+  /* Stop before the queue overflows, so there is always room on entry */
+  if (priv->tx_queue_len >= X8H7_TX_FIFO_SIZE) {
+    netif_stop_queue(net);
+  }
+  spin_unlock(&priv->tx_lock);
 
-  x8h7_pkt_send_sync(priv->periph,
-                     X8H7_CAN_OC_SEND,
-                     X8H7_CAN_HEADER_SIZE + priv->tx_frame.field.len, /* Send 4-Byte ID, 1-Byte Length and the required number of data bytes. */
-                     priv->tx_frame.buf);
+  return NETDEV_TX_OK;
 }
 
 /**
@@ -469,9 +990,11 @@ static int x8h7_can_do_set_mode(struct net_device *net, enum can_mode mode)
 static int x8h7_can_do_get_berr_counter(const struct net_device *net,
                                         struct can_berr_counter *bec)
 {
-  //@TODO: to be read from device
-  bec->txerr = 0;
-  bec->rxerr = 0;
+  const struct x8h7_can_priv *priv = netdev_priv(net);
+
+  /* Last counters reported by H7 with X8H7_CAN_OC_STS */
+  bec->txerr = priv->bec.txerr;
+  bec->rxerr = priv->bec.rxerr;
 
   return 0;
 }
@@ -500,9 +1023,95 @@ static int x8h7_can_hw_config_filter(struct x8h7_can_priv *priv,
 
   DBG_PRINT("SEND idx %X, id %X, mask %X\n", idx, id, mask);
 
-  x8h7_pkt_send_sync(priv->periph, X8H7_CAN_OC_FLT, sizeof(x8h7_msg.buf), x8h7_msg.buf);
+  return x8h7_pkt_send_sync(priv->periph, X8H7_CAN_OC_FLT, sizeof(x8h7_msg.buf), x8h7_msg.buf);
+}
 
-  return 0;
+/**
+ * Program a whole filter table packing as many X8H7_CAN_OC_FLT sub-packets
+ * as possible in every SPI frame, instead of one transaction per filter.
+ */
+static int x8h7_can_hw_config_filters(struct x8h7_can_priv *priv,
+                                      union x8h7_can_filter_message *flt,
+                                      int const num)
+{
+  int i;
+  int ret;
+
+  for (i = 0; i < num; i++) {
+    DBG_PRINT("DEFER idx %X, id %X, mask %X\n", flt[i].field.idx, flt[i].field.id, flt[i].field.mask);
+
+    ret = x8h7_pkt_send_defer(priv->periph, X8H7_CAN_OC_FLT, sizeof(flt[i].buf), flt[i].buf);
+    if (ret == -ENOMEM) {
+      /* Current SPI frame is full, flush it and start a new one */
+      ret = x8h7_pkt_send_now();
+      if (ret < 0) {
+        return ret;
+      }
+      ret = x8h7_pkt_send_defer(priv->periph, X8H7_CAN_OC_FLT, sizeof(flt[i].buf), flt[i].buf);
+    }
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  return x8h7_pkt_send_now();
+}
+
+/**
+ * Fill flt with all configured (non-zero mask) filters, standard first.
+ * Extended filter ids carry CAN_EFF_FLAG as on the wire.
+ */
+static int x8h7_can_flt_table_get(struct x8h7_can_priv *priv,
+                                  union x8h7_can_filter_message *flt)
+{
+  int num;
+  int i;
+
+  num = 0;
+  for (i = 0; i < X8H7_STD_FLT_MAX; i++) {
+    if (priv->std_flt[i].can_mask) {
+      flt[num].field.idx  = i;
+      flt[num].field.id   = priv->std_flt[i].can_id;
+      flt[num].field.mask = priv->std_flt[i].can_mask;
+      num++;
+    }
+  }
+  for (i = 0; i < X8H7_EXT_FLT_MAX; i++) {
+    if (priv->ext_flt[i].can_mask) {
+      flt[num].field.idx  = i;
+      flt[num].field.id   = CAN_EFF_FLAG | priv->ext_flt[i].can_id;
+      flt[num].field.mask = priv->ext_flt[i].can_mask;
+      num++;
+    }
+  }
+  return num;
+}
+
+/**
+ * Re-program the shadow filter tables after the H7 CAN peripheral
+ * has been (re)initialized.
+ */
+static int x8h7_can_hw_restore_filters(struct x8h7_can_priv *priv)
+{
+  union x8h7_can_filter_message *flt;
+  int                            num;
+  int                            ret;
+
+  flt = kcalloc(X8H7_FLT_MAX, sizeof(*flt), GFP_KERNEL);
+  if (!flt) {
+    return -ENOMEM;
+  }
+
+  ret = 0;
+  mutex_lock(&priv->flt_lock);
+  num = x8h7_can_flt_table_get(priv, flt);
+  if (num) {
+    ret = x8h7_can_hw_config_filters(priv, flt, num);
+  }
+  mutex_unlock(&priv->flt_lock);
+
+  kfree(flt);
+  return ret < 0 ? ret : 0;
 }
 
 /**
@@ -516,6 +1125,7 @@ static ssize_t x8h7_can_sf_show(struct device *dev,
   int                   i;
 
   len = 0;
+  mutex_lock(&priv->flt_lock);
   for (i = 0; i < X8H7_STD_FLT_MAX; i++)
   {
     if (priv->std_flt[i].can_mask) {
@@ -524,6 +1134,7 @@ static ssize_t x8h7_can_sf_show(struct device *dev,
                       i, priv->std_flt[i].can_id, priv->std_flt[i].can_mask);
     }
   }
+  mutex_unlock(&priv->flt_lock);
   return len;
 }
 
@@ -553,14 +1164,17 @@ static ssize_t x8h7_can_sf_store(struct device *dev,
     return -EINVAL;
   }
 
+  mutex_lock(&priv->flt_lock);
   ret = x8h7_can_hw_config_filter(priv, idx, id, mask);
   if (ret) {
+    mutex_unlock(&priv->flt_lock);
     DBG_ERROR("set filter\n");
     return -EIO;
   }
 
   priv->std_flt[idx].can_id   = id;
   priv->std_flt[idx].can_mask = mask;
+  mutex_unlock(&priv->flt_lock);
 
   return count;
 }
@@ -576,6 +1190,7 @@ static ssize_t x8h7_can_ef_show(struct device *dev,
   int                   i;
 
   len = 0;
+  mutex_lock(&priv->flt_lock);
   for (i = 0; i < X8H7_EXT_FLT_MAX; i++)
   {
     if (priv->ext_flt[i].can_mask) {
@@ -584,6 +1199,7 @@ static ssize_t x8h7_can_ef_show(struct device *dev,
                       i, priv->ext_flt[i].can_id, priv->ext_flt[i].can_mask);
     }
   }
+  mutex_unlock(&priv->flt_lock);
   return len;
 }
 
@@ -613,14 +1229,115 @@ static ssize_t x8h7_can_ef_store(struct device *dev,
     return -EINVAL;
   }
 
+  mutex_lock(&priv->flt_lock);
   ret = x8h7_can_hw_config_filter(priv, idx, (CAN_EFF_FLAG | id), mask);
   if (ret) {
+    mutex_unlock(&priv->flt_lock);
     DBG_ERROR("set filter\n");
     return -EIO;
   }
 
   priv->ext_flt[idx].can_id   = id;
   priv->ext_flt[idx].can_mask = mask;
+  mutex_unlock(&priv->flt_lock);
+
+  return count;
+}
+
+/**
+ * Filter table read: all configured filters as an array of
+ * union x8h7_can_filter_message, standard filters first.
+ */
+static ssize_t x8h7_can_flt_table_read(struct file *filp, struct kobject *kobj,
+                                       struct bin_attribute *attr,
+                                       char *buf, loff_t off, size_t count)
+{
+  struct x8h7_can_priv          *priv = netdev_priv(to_net_dev(kobj_to_dev(kobj)));
+  union x8h7_can_filter_message *flt;
+  size_t                         len;
+
+  flt = kcalloc(X8H7_FLT_MAX, sizeof(*flt), GFP_KERNEL);
+  if (!flt) {
+    return -ENOMEM;
+  }
+
+  mutex_lock(&priv->flt_lock);
+  len = x8h7_can_flt_table_get(priv, flt) * sizeof(*flt);
+  mutex_unlock(&priv->flt_lock);
+  if (off >= len) {
+    count = 0;
+  } else {
+    count = min_t(size_t, count, len - off);
+    memcpy(buf, (uint8_t *)flt + off, count);
+  }
+
+  kfree(flt);
+  return count;
+}
+
+/**
+ * Filter table write: an array of union x8h7_can_filter_message records,
+ * CAN_EFF_FLAG in id selects the extended filter bank. All records of
+ * a single write are programmed in as few SPI transactions as possible.
+ * The table fits in one write, partial writes at an offset are refused.
+ */
+static ssize_t x8h7_can_flt_table_write(struct file *filp, struct kobject *kobj,
+                                        struct bin_attribute *attr,
+                                        char *buf, loff_t off, size_t count)
+{
+  struct x8h7_can_priv          *priv = netdev_priv(to_net_dev(kobj_to_dev(kobj)));
+  union x8h7_can_filter_message *flt;
+  uint32_t                       id;
+  int                            num;
+  int                            ret;
+  int                            i;
+
+  if (off != 0) {
+    DBG_ERROR("invalid table offset %lld\n", off);
+    return -EINVAL;
+  }
+  if ((count == 0) || (count % sizeof(*flt))) {
+    DBG_ERROR("invalid table size %zu\n", count);
+    return -EINVAL;
+  }
+  num = count / sizeof(*flt);
+  flt = (union x8h7_can_filter_message *)buf;
+
+  for (i = 0; i < num; i++) {
+    if (flt[i].field.id & CAN_EFF_FLAG) {
+      id = flt[i].field.id & ~CAN_EFF_FLAG;
+      if ((flt[i].field.idx >= X8H7_EXT_FLT_MAX) ||
+          (id & ~0x1FFFFFFF) || (flt[i].field.mask & ~0x1FFFFFFF)) {
+        DBG_ERROR("invalid params at record %d\n", i);
+        return -EINVAL;
+      }
+    } else {
+      if ((flt[i].field.idx >= X8H7_STD_FLT_MAX) ||
+          (flt[i].field.id & ~0x7FF) || (flt[i].field.mask & ~0x7FF)) {
+        DBG_ERROR("invalid params at record %d\n", i);
+        return -EINVAL;
+      }
+    }
+  }
+
+  mutex_lock(&priv->flt_lock);
+  ret = x8h7_can_hw_config_filters(priv, flt, num);
+  if (ret < 0) {
+    mutex_unlock(&priv->flt_lock);
+    DBG_ERROR("set filter table\n");
+    return -EIO;
+  }
+
+  for (i = 0; i < num; i++) {
+    if (flt[i].field.id & CAN_EFF_FLAG) {
+      priv->ext_flt[flt[i].field.idx].can_id   = flt[i].field.id & ~CAN_EFF_FLAG;
+      priv->ext_flt[flt[i].field.idx].can_mask = flt[i].field.mask;
+    } else {
+      priv->std_flt[flt[i].field.idx].can_id   = flt[i].field.id;
+      priv->std_flt[flt[i].field.idx].can_mask = flt[i].field.mask;
+    }
+  }
+  mutex_unlock(&priv->flt_lock);
 
   return count;
 }
@@ -639,6 +1356,9 @@ static ssize_t x8h7_can_sts_show(struct device *dev,
                   "error warning  %d\n"
                   "error passive  %d\n"
                   "bus off        %d\n"
+                  "restarts       %d\n"
+                  "tx err counter %d\n"
+                  "rx err counter %d\n"
                   "tx packets     %ld\n"
                   "tx bytes       %ld\n"
                   "rx packets     %ld\n"
@@ -650,6 +1370,9 @@ static ssize_t x8h7_can_sts_show(struct device *dev,
                   priv->can.can_stats.error_warning,
                   priv->can.can_stats.error_passive,
                   priv->can.can_stats.bus_off,
+                  priv->can.can_stats.restarts,
+                  priv->bec.txerr,
+                  priv->bec.rxerr,
                   priv->net->stats.tx_packets,
                   priv->net->stats.tx_bytes,
                   priv->net->stats.rx_packets,
@@ -663,6 +1386,8 @@ static ssize_t x8h7_can_sts_show(struct device *dev,
 static DEVICE_ATTR(std_flt, 0644, x8h7_can_sf_show, x8h7_can_sf_store);
 static DEVICE_ATTR(ext_flt, 0644, x8h7_can_ef_show, x8h7_can_ef_store);
 static DEVICE_ATTR(status , 0644, x8h7_can_sts_show, NULL);
+static BIN_ATTR(flt_table, 0644, x8h7_can_flt_table_read, x8h7_can_flt_table_write,
+                X8H7_FLT_MAX * sizeof(union x8h7_can_filter_message));
 
 static struct attribute *x8h7_can_sysfs_attrs[] = {
   &dev_attr_std_flt.attr,
@@ -672,9 +1397,15 @@ static struct attribute *x8h7_can_sysfs_attrs[] = {
   NULL,
 };
 
+static struct bin_attribute *x8h7_can_sysfs_bin_attrs[] = {
+  &bin_attr_flt_table,
+  NULL,
+};
+
 static const struct attribute_group x8h7_can_sysfs_attr_group = {
   .name = "x8h7can",
   .attrs = (struct attribute **)x8h7_can_sysfs_attrs,
+  .bin_attrs = x8h7_can_sysfs_bin_attrs,
 };
 
 /**
@@ -694,7 +1425,7 @@ static int x8h7_can_probe(struct platform_device *pdev)
     DBG_PRINT("fdcan_clk = %d", clock_freq);
   }
 
-  net = alloc_candev(sizeof(struct x8h7_can_priv), 1);
+  net = alloc_candev(sizeof(struct x8h7_can_priv), X8H7_TX_MB_NUM);
   if (!net) {
     return -ENOMEM;
   }
@@ -714,6 +1445,12 @@ static int x8h7_can_probe(struct platform_device *pdev)
                                   CAN_CTRLMODE_LISTENONLY    |
                                   CAN_CTRLMODE_3_SAMPLES     ;
   priv->net = net;
+  INIT_WORK(&priv->restart_work, x8h7_can_restart_work_handler);
+  INIT_WORK(&priv->tx_retry_work, x8h7_can_tx_retry_work_handler);
+  spin_lock_init(&priv->tx_lock);
+  /* Single frame in flight until the H7 proves it echoes TX tags */
+  priv->tx_mb_max = 1;
+  mutex_init(&priv->flt_lock);
 
   platform_set_drvdata(pdev, priv);
 
@@ -736,6 +1473,8 @@ static int x8h7_can_probe(struct platform_device *pdev)
   priv->dev = &pdev->dev;
   DBG_PRINT("periph: %d DONE\n", priv->periph);
 
+  x8h7_can_stats_init(priv);
+
   netdev_info(net, "X8H7 CAN successfully initialized.\n");
 
   return 0;
@@ -753,6 +1492,7 @@ static int x8h7_can_remove(struct platform_device *pdev)
   struct x8h7_can_priv *priv = platform_get_drvdata(pdev);
   struct net_device    *net = priv->net;
 
+  debugfs_remove_recursive(priv->stats.dir);
   unregister_candev(net);
   free_candev(net);
 
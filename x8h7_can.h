@@ -12,6 +12,7 @@
 #include <linux/timer.h>
 #include <linux/can/dev.h>
 #include <linux/workqueue.h>
+#include <linux/debugfs.h>
 
 /**
  * DEFINES
@@ -42,17 +43,41 @@
 #define X8H7_CAN_STS_FLG_EWARN   0x40  // Error Warning
 #define X8H7_CAN_STS_FLG_TX_OVR  0x80  // Transmit Buffer Overflow
 
+#define X8H7_CAN_STS_SIZE           2  // intf, eflag
+#define X8H7_CAN_STS_BEC_SIZE       4  // intf, eflag, tec, rec
+                                       // followed by the TX complete tags
+
+#define X8H7_CAN_ERR_WARNING_LIMIT   96
+#define X8H7_CAN_ERR_PASSIVE_LIMIT  128
+
 #define X8H7_CAN_HEADER_SIZE        5
 #define X8H7_CAN_FRAME_MAX_DATA_LEN 8
+#define X8H7_CAN_TX_TAG_SIZE        1  // TX buffer tag trailing the data
 
 #define X8H7_STD_FLT_MAX  128
 #define X8H7_EXT_FLT_MAX   64
+#define X8H7_FLT_MAX      (X8H7_STD_FLT_MAX + X8H7_EXT_FLT_MAX)
+
+#define X8H7_TX_FIFO_SIZE  32  // Software priority queue depth
+#define X8H7_TX_MB_NUM      4  // Frames in flight in the H7 TX buffers,
+                                // must fit the x8h7 async packet queue
 
-#define X8H7_TX_FIFO_SIZE  32
+#define X8H7_CAN_STATS_SLOT_MS   100  // Bus load accounting granularity
+#define X8H7_CAN_STATS_SLOT_NUM  100  // 10 s of bus load history
+#define X8H7_CAN_STATS_ID_BITS     8
+#define X8H7_CAN_STATS_ID_NUM    (1 << X8H7_CAN_STATS_ID_BITS)
+#define X8H7_CAN_STATS_ID_PROBE    8  // Max linear probing in id table
+#define X8H7_CAN_STATS_TOP        32  // Top talkers shown in debugfs
 
 /**
  * TYPEDEFS
  */
+struct x8h7_can_tx_entry {
+  struct sk_buff           *skb;
+  uint32_t                  prio;
+  uint32_t                  seq;
+};
+
 union x8h7_can_init_message
 {
   struct __attribute__((packed))
@@ -96,7 +121,30 @@ union x8h7_can_frame_message
     uint8_t  len;
     uint8_t  data[X8H7_CAN_FRAME_MAX_DATA_LEN];
   } field;
-  uint8_t buf[X8H7_CAN_HEADER_SIZE + X8H7_CAN_FRAME_MAX_DATA_LEN];
+  uint8_t buf[X8H7_CAN_HEADER_SIZE + X8H7_CAN_FRAME_MAX_DATA_LEN + X8H7_CAN_TX_TAG_SIZE];
+};
+
+struct x8h7_can_id_stats {
+  canid_t                   can_id;
+  uint32_t                  rx;
+  uint32_t                  tx;
+};
+
+struct x8h7_can_stats {
+  bool                      enable;
+  spinlock_t                lock;
+  struct dentry            *dir;
+  /* Bus load: bits on the wire per slot, ring of slots */
+  unsigned long             slot_start;
+  int                       slot;
+  uint32_t                  bits[X8H7_CAN_STATS_SLOT_NUM];
+  /* Per id frame counters, open addressing hash table */
+  struct x8h7_can_id_stats  id[X8H7_CAN_STATS_ID_NUM];
+  uint32_t                  id_used;
+  uint64_t                  id_untracked;
+  /* Overflow events signaled by X8H7_CAN_STS_FLG_* */
+  uint32_t                  rx_overflow;
+  uint32_t                  tx_overflow;
 };
 
 struct x8h7_can_priv {
@@ -105,16 +153,34 @@ struct x8h7_can_priv {
   struct device            *dev;
   int                       periph;
 
-  int                       tx_len;
-
-  struct workqueue_struct     *wq;
-  struct work_struct           work;
-  union x8h7_can_frame_message tx_frame;
-
+  /* TX scheduler: ID-ordered software queue feeding the H7 TX buffers */
+  spinlock_t                tx_lock;
+  struct x8h7_can_tx_entry  tx_queue[X8H7_TX_FIFO_SIZE];
+  int                       tx_queue_len;
+  uint32_t                  tx_seq;
+  /* In-flight frames are released by the tag echoed in the TX complete
+   * status, echo index == tag == mailbox. Untagged firmware gets a single
+   * frame in flight.
+   */
+  int                       tx_mb_len[X8H7_TX_MB_NUM];
+  canid_t                   tx_mb_id[X8H7_TX_MB_NUM];
+  unsigned long             tx_mb_used;
+  int                       tx_mb_cnt;
+  int                       tx_mb_max;
+  /* Transport queue was full, flush it and dispatch again */
+  struct work_struct        tx_retry_work;
+
+  struct can_berr_counter   bec;
+  struct work_struct        restart_work;
+
+  /* Filter shadow tables and their programming, flt_lock held */
+  struct mutex              flt_lock;
   struct can_filter         std_flt[X8H7_STD_FLT_MAX];
   struct can_filter         ext_flt[X8H7_EXT_FLT_MAX];
 
   struct mutex              lock;
+
+  struct x8h7_can_stats     stats;
 };
 
 #endif
@@ -36,6 +36,8 @@
 #include <linux/of.h>
 #include <linux/of_device.h>
 #include <linux/interrupt.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include <linux/spi/spi.h>
 #include <linux/spi/spidev.h>
@@ -59,8 +61,17 @@ struct spidev_data {
   u8                 *x8h7_rxb;
   u16                 fixed_length;
   struct gpio_desc   *flow_ctrl_gpio;
+  /* Packets queued from atomic context, merged in the next SPI frame */
+  spinlock_t          async_lock;
+  x8h7_pkt_t         *async_pkt;
+  int                 async_head;
+  int                 async_cnt;
+  struct work_struct  async_work;
 };
 
+/* Enough for all CAN TX buffers of both interfaces */
+#define X8H7_ASYNC_PKT_NUM  16
+
 /*-------------------------------------------------------------------------*/
 
 struct spidev_data  *x8h7_spidev = NULL;
@@ -80,7 +91,6 @@ typedef struct __attribute__((packed, aligned(4))) {
   uint16_t  size;
 } x8h7_subpkt_t;
 
-#define X8H7_PERIPH_NUM   16
 x8h7_hook_t x8h7_hook[X8H7_PERIPH_NUM] = {};
 void *x8h7_hook_priv[X8H7_PERIPH_NUM];
 
@@ -168,13 +178,18 @@ void pkt_dump(char *title, void *data) {}
 #endif
 
 /**
+ * Enqueue a sub-packet whose payload is made of two segments,
+ * copied once straight into the TX buffer (e.g. a wrapped ring buffer)
  */
-int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
+static int x8h7_pkt_enq_sg(uint8_t peripheral, uint8_t opcode,
+                           uint16_t size1, const void *data1,
+                           uint16_t size2, const void *data2)
 {
   struct spidev_data *spidev = x8h7_spidev;
   x8h7_pkthdr_t      *hdr;
   x8h7_subpkt_t      *pkt;
   uint8_t            *ptr;
+  uint16_t            size = size1 + size2;
 
   ptr = spidev->x8h7_txb;
   hdr = (x8h7_pkthdr_t*)ptr;
@@ -186,13 +201,16 @@ int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
     pkt->opcode     = opcode;
     pkt->size       = size;
     ptr += sizeof(x8h7_subpkt_t);
-    if (size) {
-      if (!data) {
-        memset(ptr, 0, size);
+    if (size1) {
+      if (!data1) {
+        memset(ptr, 0, size1);
       } else {
-        memcpy(ptr, data, size);
+        memcpy(ptr, data1, size1);
       }
     }
+    if (size2) {
+      memcpy(ptr + size1, data2, size2);
+    }
     hdr->size += sizeof(x8h7_subpkt_t) + size;
     hdr->checksum = hdr->size ^ 0x5555;
     spidev->x8h7_txl = hdr->size;
@@ -202,38 +220,60 @@ int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
   return -ENOMEM;
 }
 
+/**
+ */
+int x8h7_pkt_enq(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
+{
+  return x8h7_pkt_enq_sg(peripheral, opcode, size, data, 0, NULL);
+}
+
 static int x8h7_pkt_send(void);
+static void x8h7_pkt_async_drain(struct spidev_data *spidev);
 /**
  */
 int x8h7_pkt_send_sync(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
+{
+  return x8h7_pkt_send_sync_sg(peripheral, opcode, size, data, 0, NULL);
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_sync);
+
+/**
+ * Same as x8h7_pkt_send_sync with the payload split in two segments
+ */
+int x8h7_pkt_send_sync_sg(uint8_t peripheral, uint8_t opcode,
+                          uint16_t size1, const void *data1,
+                          uint16_t size2, const void *data2)
 {
   struct spidev_data *spidev = x8h7_spidev;
+  int                 ret;
 
   /* Guard: spi access request happening before spidev data initialized */
-  if(spidev == NULL) {
+  if (spidev == NULL) {
     return -EPROBE_DEFER;
   }
 
-  int ret;
-
   mutex_lock(&spidev->lock);
-  ret = x8h7_pkt_enq(peripheral, opcode, size, data);
+  x8h7_pkt_async_drain(spidev);
+  ret = x8h7_pkt_enq_sg(peripheral, opcode, size1, data1, size2, data2);
+  if (ret == -ENOMEM) {
+    /* Frame full of earlier packets, send them first */
+    x8h7_pkt_send();
+    ret = x8h7_pkt_enq_sg(peripheral, opcode, size1, data1, size2, data2);
+  }
   if (ret < 0) {
-    printk("x8h7_pkt_enq failed with %d", ret);
+    printk(KERN_ERR "x8h7_pkt_enq_sg failed with %d\n", ret);
     mutex_unlock(&spidev->lock);
     return ret;
   }
   ret = x8h7_pkt_send();
   if (ret < 0) {
     printk("x8h7_pkt_send failed with %d", ret);
-    mutex_unlock(&spidev->lock);
-    return ret;
   }
   mutex_unlock(&spidev->lock);
 
   return ret;
 }
-EXPORT_SYMBOL_GPL(x8h7_pkt_send_sync);
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_sync_sg);
 
 /**
  */
@@ -243,9 +283,11 @@ int x8h7_pkt_send_defer(uint8_t peripheral, uint8_t opcode, uint16_t size, void
   int ret;
 
   mutex_lock(&spidev->lock);
+  x8h7_pkt_async_drain(spidev);
   ret = x8h7_pkt_enq(peripheral, opcode, size, data);
-  if (ret < 0) {
-    printk("x8h7_pkt_enq failed with %d", ret);
+  /* -ENOMEM is a full frame, callers flush with x8h7_pkt_send_now */
+  if ((ret < 0) && (ret != -ENOMEM)) {
+    printk(KERN_ERR "x8h7_pkt_enq failed with %d\n", ret);
   }
   mutex_unlock(&spidev->lock);
   return ret;
@@ -269,6 +311,103 @@ int x8h7_pkt_send_now(void)
 }
 EXPORT_SYMBOL_GPL(x8h7_pkt_send_now);
 
+/**
+ * Enqueue a packet without sleeping, usable from atomic context.
+ * The packet is merged in the next SPI frame, a transfer is kicked
+ * if no other one takes it first.
+ */
+int x8h7_pkt_send_async(uint8_t peripheral, uint8_t opcode, uint16_t size, void *data)
+{
+  struct spidev_data *spidev = x8h7_spidev;
+  x8h7_pkt_t         *pkt;
+  unsigned long       flags;
+
+  if (spidev == NULL) {
+    return -EPROBE_DEFER;
+  }
+  if (size > X8H7_PKT_SIZE) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&spidev->async_lock, flags);
+  if (spidev->async_cnt >= X8H7_ASYNC_PKT_NUM) {
+    spin_unlock_irqrestore(&spidev->async_lock, flags);
+    return -ENOMEM;
+  }
+  pkt = &spidev->async_pkt[(spidev->async_head + spidev->async_cnt) % X8H7_ASYNC_PKT_NUM];
+  pkt->peripheral = peripheral;
+  pkt->opcode     = opcode;
+  pkt->size       = size;
+  if (size) {
+    memcpy(pkt->data, data, size);
+  }
+  spidev->async_cnt++;
+  spin_unlock_irqrestore(&spidev->async_lock, flags);
+
+  queue_work(system_highpri_wq, &spidev->async_work);
+
+  return 0;
+}
+EXPORT_SYMBOL_GPL(x8h7_pkt_send_async);
+
+/**
+ * Move packets queued by x8h7_pkt_send_async in the TX buffer,
+ * as many as fit. Called with spidev->lock held.
+ * Returns the number of packets moved.
+ */
+static int x8h7_pkt_async_enq(struct spidev_data *spidev)
+{
+  x8h7_pkt_t     *pkt;
+  unsigned long   flags;
+  int             cnt = 0;
+
+  spin_lock_irqsave(&spidev->async_lock, flags);
+  while (spidev->async_cnt) {
+    pkt = &spidev->async_pkt[spidev->async_head];
+    if (x8h7_pkt_enq(pkt->peripheral, pkt->opcode, pkt->size, pkt->data) < 0) {
+      break;
+    }
+    spidev->async_head = (spidev->async_head + 1) % X8H7_ASYNC_PKT_NUM;
+    spidev->async_cnt--;
+    cnt++;
+  }
+  spin_unlock_irqrestore(&spidev->async_lock, flags);
+
+  return cnt;
+}
+
+/**
+ * Move all packets queued by x8h7_pkt_send_async so far in the TX buffer,
+ * sending full frames as needed, so that a packet enqueued next leaves
+ * after them. Called with spidev->lock held.
+ */
+static void x8h7_pkt_async_drain(struct spidev_data *spidev)
+{
+  int pending;
+
+  pending  = READ_ONCE(spidev->async_cnt);
+  pending -= x8h7_pkt_async_enq(spidev);
+  while (pending > 0) {
+    x8h7_pkt_send();
+    pending -= x8h7_pkt_async_enq(spidev);
+  }
+}
+
+/**
+ * Kick a transfer for packets queued by x8h7_pkt_send_async,
+ * unless an interrupt or a sync send already took them.
+ */
+static void x8h7_pkt_async_work_func(struct work_struct *work)
+{
+  struct spidev_data *spidev = container_of(work, struct spidev_data, async_work);
+
+  mutex_lock(&spidev->lock);
+  if (READ_ONCE(spidev->async_cnt)) {
+    x8h7_pkt_send();
+  }
+  mutex_unlock(&spidev->lock);
+}
+
 /**
  * Function to parse data coming from h7
  * and dispatch to peripheral
@@ -379,6 +518,8 @@ static int x8h7_pkt_send(void)
 
   len = FIXED_PACKET_LEN;
 
+  x8h7_pkt_async_enq(spidev);
+
   pkt_dump("Send", spidev->x8h7_txb);
 
   x8h7_spi_trx(spidev->spi,
@@ -399,6 +540,11 @@ static int x8h7_pkt_send(void)
   memset(spidev->x8h7_rxb, 0, X8H7_BUF_SIZE);
   spidev->x8h7_txl = 0;
 
+  /* Async packets left over by a full frame go in the next one */
+  if (READ_ONCE(spidev->async_cnt)) {
+    queue_work(system_highpri_wq, &spidev->async_work);
+  }
+
   return 0;
 }
 
@@ -454,6 +600,8 @@ static int x8h7_probe(struct spi_device *spi)
   /* Initialize the driver data */
   spidev->spi = spi;
   mutex_init(&spidev->lock);
+  spin_lock_init(&spidev->async_lock);
+  INIT_WORK(&spidev->async_work, x8h7_pkt_async_work_func);
 
   /* Device speed */
   if (!of_property_read_u32(spi->dev.of_node, "spi-max-frequency", &value))
@@ -483,6 +631,15 @@ static int x8h7_probe(struct spi_device *spi)
     }
   }
 
+  if (status == 0) {
+    spidev->async_pkt = devm_kcalloc(&spi->dev, X8H7_ASYNC_PKT_NUM,
+                                     sizeof(x8h7_pkt_t), GFP_KERNEL);
+    if (!spidev->async_pkt) {
+      DBG_ERROR("X8H7 async packet memory fail\n");
+      status = -ENOMEM;
+    }
+  }
+
   memset(spidev->x8h7_txb, 0, X8H7_BUF_SIZE);
   memset(spidev->x8h7_rxb, 0, X8H7_BUF_SIZE);
   spidev->x8h7_txl = 0;
@@ -529,6 +686,7 @@ static void x8h7_remove(struct spi_device *spi)
   struct spidev_data	*spidev = spi_get_drvdata(spi);
 
   /* make sure ops on existing fds can abort cleanly */
+  cancel_work_sync(&spidev->async_work);
   kfree(spidev);
 
   return;
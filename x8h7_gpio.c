@@ -3,6 +3,7 @@
  */
 
 #include <linux/module.h>
+#include <linux/bitmap.h>
 #include <linux/device.h>
 #include <linux/wait.h>
 #include <linux/of_device.h>
@@ -14,6 +15,7 @@
 #include <linux/pinctrl/pinctrl.h>
 #include <linux/pinctrl/pinmux.h>
 #include <linux/pinctrl/pinconf-generic.h>
+#include <linux/spinlock.h>
 #include <linux/workqueue.h>
 
 #include "x8h7.h"
@@ -29,10 +31,14 @@
 #define X8H7_GPIO_OC_DIR    0x10
 #define X8H7_GPIO_OC_IRQ_TYPE    0x11
 #define X8H7_GPIO_OC_WR     0x20
+#define X8H7_GPIO_OC_WR_MULTI    0x21 // struct gpioMultiPacket
 #define X8H7_GPIO_OC_RD     0x30
+#define X8H7_GPIO_OC_RD_MULTI    0x31 // req: uint64_t mask, rsp: struct gpioMultiPacket
 #define X8H7_GPIO_OC_IEN    0x40
-#define X8H7_GPIO_OC_INT    0x50
+#define X8H7_GPIO_OC_INT    0x50 // one byte per pin that fired
 #define X8H7_GPIO_OC_IACK   0x60
+#define X8H7_GPIO_OC_IN_CHG      0x70 // H7 pushed input state, struct gpioMultiPacket
+#define X8H7_GPIO_OC_IN_NOTIFY   0x71 // uint64_t mask of inputs to report
 
 //#define GPIO_MODE_INPUT         0x00   /*!< Input Floating Mode */
 //#define GPIO_MODE_OUTPUT_PP     0x01   /*!< Output Push Pull Mode */
@@ -52,6 +58,17 @@
 
 #define X8H7_GPIO_NUM   34
 
+/*
+ * Several pins in one transaction, bit n is gpio n. Write sets the
+ * pins in mask to val, read returns the state of the pins in mask.
+ * Same layout for X8H7_GPIO_OC_IN_CHG: H7 reports the subscribed inputs
+ * once on X8H7_GPIO_OC_IN_NOTIFY and then each time one changes.
+ */
+struct __attribute__((packed)) gpioMultiPacket {
+  uint64_t mask;
+  uint64_t val;
+};
+
 struct x8h7_gpio_info {
   struct device      *dev;
   wait_queue_head_t   wait;
@@ -61,15 +78,21 @@ struct x8h7_gpio_info {
   struct pinctrl_dev *pctldev;
   struct pinctrl_desc pinctrl_desc;
   struct gpio_chip    gc;
-  uint32_t            gpio_dir;
-  uint32_t            gpio_val;
+  uint64_t            gpio_dir;
+  uint64_t            gpio_val;   // outputs: shadow, inputs: valid with in_valid
+  uint64_t            in_valid;   // inputs kept up to date by H7
+  uint64_t            in_notify;  // inputs subscribed with X8H7_GPIO_OC_IN_NOTIFY
+  uint64_t            gpio_od;    // open drain outputs, line may differ from shadow
+  spinlock_t          val_lock;
   uint8_t             gpio_ien;
   uint8_t             irq_conf;
   struct irq_domain  *irq;
   struct mutex lock;
   struct work_struct work;
   struct workqueue_struct *workqueue;
-  uint64_t offload_irq;
+  /* Interrupts received from H7, handled in gpio_irq_work_func */
+  DECLARE_BITMAP(irq_pending, X8H7_GPIO_NUM);
+  atomic_t irq_cnt[X8H7_GPIO_NUM];
 };
 
 // @TODO: add remaining gpios
@@ -117,34 +140,78 @@ static void x8h7_gpio_irq_offload(struct x8h7_gpio_info *inf)
     queue_work(inf->workqueue, &inf->work);
 }
 
-/* Worqueue for gpio_irq_ack handling */
+/* Worqueue for gpio_irq_ack handling, every edge received is delivered */
 static void gpio_irq_work_func(struct work_struct *work)
 {
   struct x8h7_gpio_info *inf = container_of(work, struct x8h7_gpio_info, work);
   unsigned long irq = 0;
-  uint8_t hwirq = inf->offload_irq;
+  unsigned int hwirq;
+  int cnt;
+
+  while (!bitmap_empty(inf->irq_pending, X8H7_GPIO_NUM)) {
+    for_each_set_bit(hwirq, inf->irq_pending, X8H7_GPIO_NUM) {
+      /*
+       * Fully ordered: the count is read after the bit is cleared, so
+       * an edge counted after the xchg sets the bit again and is
+       * delivered on the next pass. Pairs with x8h7_gpio_hook.
+       */
+      if (!test_and_clear_bit(hwirq, inf->irq_pending)) {
+        continue;
+      }
+      irq = irq_linear_revmap(inf->irq, hwirq);
+      cnt = atomic_xchg(&inf->irq_cnt[hwirq], 0);
+      while (cnt-- > 0) {
+        handle_nested_irq(irq);
+        DBG_PRINT("call handle_nested_irq(%d)\n", hwirq);
+      }
+    }
+  }
+}
 
-  irq = irq_linear_revmap(inf->irq, hwirq);
-  handle_nested_irq(irq);
-  DBG_PRINT("call handle_nested_irq(%d)\n", hwirq);
-  return;
+/**
+ * Input state pushed by H7
+ */
+static void x8h7_gpio_in_chg(struct x8h7_gpio_info *inf, x8h7_pkt_t *pkt)
+{
+  struct gpioMultiPacket  *chg = (struct gpioMultiPacket *)pkt->data;
+  uint64_t                 m;
+
+  spin_lock(&inf->val_lock);
+  m = chg->mask & inf->in_notify & ~inf->gpio_dir;
+  inf->gpio_val = (inf->gpio_val & ~m) | (chg->val & m);
+  inf->in_valid |= m;
+  spin_unlock(&inf->val_lock);
+  DBG_PRINT("input change mask %09llX val %09llX\n", chg->mask, chg->val);
 }
 
 static void x8h7_gpio_hook(void *priv, x8h7_pkt_t *pkt)
 {
   struct x8h7_gpio_info  *inf = (struct x8h7_gpio_info*)priv;
-  unsigned long irq = 0;
   uint8_t hwirq = 0;
+  int i;
 
   if ((pkt->peripheral == X8H7_GPIO_PERIPH) &&
       (pkt->opcode == X8H7_GPIO_OC_INT) &&
-      (pkt->size == 1)) {
-    if (pkt->data[0] < X8H7_GPIO_NUM) {
-      hwirq = pkt->data[0];
-      inf->offload_irq = hwirq;
-      x8h7_gpio_irq_offload(inf);
-      DBG_PRINT("call x8h7_gpio_irq(%d)\n", inf->offload_irq);
+      (pkt->size >= 1)) {
+    for (i = 0; i < pkt->size; i++) {
+      hwirq = pkt->data[i];
+      if (hwirq < X8H7_GPIO_NUM) {
+        /*
+         * Count first, then flag. Pairs with test_and_clear_bit then
+         * atomic_xchg in gpio_irq_work_func: a work that sees the bit
+         * also sees the count.
+         */
+        atomic_inc(&inf->irq_cnt[hwirq]);
+        smp_mb__after_atomic();
+        set_bit(hwirq, inf->irq_pending);
+        DBG_PRINT("call x8h7_gpio_irq(%d)\n", hwirq);
+      }
     }
+    x8h7_gpio_irq_offload(inf);
+  } else if ((pkt->peripheral == X8H7_GPIO_PERIPH) &&
+             (pkt->opcode == X8H7_GPIO_OC_IN_CHG) &&
+             (pkt->size == sizeof(struct gpioMultiPacket))) {
+    x8h7_gpio_in_chg(inf, pkt);
   } else {
     memcpy(&inf->rx_pkt, pkt, sizeof(x8h7_pkt_t));
     inf->rx_cnt++;
@@ -167,6 +234,29 @@ static int x8h7_gpio_pkt_get(struct x8h7_gpio_info *inf)
   return 0;
 }
 
+/**
+ * Ask H7 to report input changes of pin, or stop reporting them.
+ * The cached value is valid again after the first report.
+ */
+static void x8h7_gpio_notify(struct x8h7_gpio_info *inf, unsigned offset,
+                             bool enable)
+{
+  uint64_t mask;
+
+  spin_lock(&inf->val_lock);
+  inf->in_valid &= ~BIT_ULL(offset);
+  if (enable) {
+    inf->in_notify |= BIT_ULL(offset);
+  } else {
+    inf->in_notify &= ~BIT_ULL(offset);
+  }
+  mask = inf->in_notify;
+  spin_unlock(&inf->val_lock);
+
+  x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_IN_NOTIFY,
+                     sizeof(mask), &mask);
+}
+
 static int x8h7_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
 {
   struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
@@ -177,14 +267,17 @@ static int x8h7_gpio_direction_input(struct gpio_chip *chip, unsigned offset)
     DBG_ERROR("offset out of reange\n");
     return -EINVAL;
   }
-  inf->gpio_dir &= ~(1 << offset);
+  spin_lock(&inf->val_lock);
+  inf->gpio_dir &= ~BIT_ULL(offset);
+  spin_unlock(&inf->val_lock);
 
   data[0] = offset;
   data[1] = GPIO_MODE_INPUT;
 
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_DIR, 2, data);
+  x8h7_gpio_notify(inf, offset, true);
 
-  DBG_PRINT(" dir %08X\n", inf->gpio_dir);
+  DBG_PRINT(" dir %09llX\n", inf->gpio_dir);
   return 0;
 }
 
@@ -192,6 +285,7 @@ static int x8h7_gpio_get(struct gpio_chip *chip, unsigned offset)
 {
   struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
   uint8_t                 data[1];
+  int                     ret;
 
   DBG_PRINT("offset: %d\n", offset);
   if (offset >= inf->gc.ngpio) {
@@ -199,6 +293,15 @@ static int x8h7_gpio_get(struct gpio_chip *chip, unsigned offset)
     return -EINVAL;
   }
 
+  /* Outputs from shadow, inputs from H7 pushed state when available */
+  spin_lock(&inf->val_lock);
+  if (((inf->gpio_dir & ~inf->gpio_od) | inf->in_valid) & BIT_ULL(offset)) {
+    ret = !!(inf->gpio_val & BIT_ULL(offset));
+    spin_unlock(&inf->val_lock);
+    return ret;
+  }
+  spin_unlock(&inf->val_lock);
+
   data[0] = offset;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD, 1, data);
   if (x8h7_gpio_pkt_get(inf) < 0)
@@ -207,14 +310,16 @@ static int x8h7_gpio_get(struct gpio_chip *chip, unsigned offset)
   if ((inf->rx_pkt.peripheral == X8H7_GPIO_PERIPH) &&
       (inf->rx_pkt.opcode == X8H7_GPIO_OC_RD) &&
       (inf->rx_pkt.size == 2)) {
+    spin_lock(&inf->val_lock);
     if (inf->rx_pkt.data[1]) {
-      inf->gpio_val |= 1 << offset;
+      inf->gpio_val |= BIT_ULL(offset);
     } else {
-      inf->gpio_val &= ~(1 << offset);
+      inf->gpio_val &= ~BIT_ULL(offset);
     }
+    spin_unlock(&inf->val_lock);
   }
-  DBG_PRINT("read %08X\n", inf->gpio_val);
-  return !!(inf->gpio_val & (1 << offset));
+  DBG_PRINT("read %09llX\n", inf->gpio_val);
+  return !!(inf->gpio_val & BIT_ULL(offset));
 }
 
 static int x8h7_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
@@ -228,19 +333,24 @@ static int x8h7_gpio_direction_output(struct gpio_chip *chip, unsigned offset,
     DBG_ERROR("offset out of reange\n");
     return -EINVAL;
   }
-  inf->gpio_dir |= (1 << offset);
+  if (inf->in_notify & BIT_ULL(offset)) {
+    x8h7_gpio_notify(inf, offset, false);
+  }
+  spin_lock(&inf->val_lock);
+  inf->gpio_dir |= BIT_ULL(offset);
   if (value) {
-    inf->gpio_val |= (1 << offset);
+    inf->gpio_val |= BIT_ULL(offset);
   } else {
-    inf->gpio_val &= ~(1 << offset);
+    inf->gpio_val &= ~BIT_ULL(offset);
   }
+  spin_unlock(&inf->val_lock);
   data[0] = offset;
   data[1] = !!value;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR, 2, data);
   data[1] = GPIO_MODE_OUTPUT_PP;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_DIR, 2, data);
 
-  DBG_PRINT("dir %08X write %08X\n", inf->gpio_dir, inf->gpio_val);
+  DBG_PRINT("dir %09llX write %09llX\n", inf->gpio_dir, inf->gpio_val);
   return 0;
 }
 
@@ -255,17 +365,89 @@ static void x8h7_gpio_set(struct gpio_chip *chip, unsigned offset, int value)
     return;
   }
 
-  if (value) {
-    inf->gpio_val |= (1 << offset);
-  } else {
-    inf->gpio_val &= ~(1 << offset);
+  /* Inputs keep the state pushed by H7 */
+  spin_lock(&inf->val_lock);
+  if (inf->gpio_dir & BIT_ULL(offset)) {
+    if (value) {
+      inf->gpio_val |= BIT_ULL(offset);
+    } else {
+      inf->gpio_val &= ~BIT_ULL(offset);
+    }
   }
+  spin_unlock(&inf->val_lock);
 
   data[0] = offset;
   data[1] = !!value;
   x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR, 2, data);
 
-  DBG_PRINT("write %08X\n", inf->gpio_val);
+  DBG_PRINT("write %09llX\n", inf->gpio_val);
+}
+
+static void x8h7_gpio_set_multiple(struct gpio_chip *chip, unsigned long *mask,
+                                   unsigned long *bits)
+{
+  struct x8h7_gpio_info   *inf = gpiochip_get_data(chip);
+  struct gpioMultiPacket   pkt;
+  uint64_t                 m;
+
+  bitmap_to_arr64(&pkt.mask, mask, X8H7_GPIO_NUM);
+  bitmap_to_arr64(&pkt.val, bits, X8H7_GPIO_NUM);
+  pkt.val &= pkt.mask;
+  DBG_PRINT("mask: %09llX, value: %09llX\n", pkt.mask, pkt.val);
+
+  /* Inputs keep the state pushed by H7, same as x8h7_gpio_set */
+  spin_lock(&inf->val_lock);
+  m = pkt.mask & inf->gpio_dir;
+  inf->gpio_val = (inf->gpio_val & ~m) | (pkt.val & m);
+  spin_unlock(&inf->val_lock);
+  x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_WR_MULTI,
+                     sizeof(pkt), &pkt);
+
+  DBG_PRINT("write %09llX\n", inf->gpio_val);
+}
+
+static int x8h7_gpio_get_multiple(struct gpio_chip *chip, unsigned long *mask,
+                                  unsigned long *bits)
+{
+  struct x8h7_gpio_info   *inf = gpiochip_get_data(chip);
+  struct gpioMultiPacket  *rsp = (struct gpioMultiPacket *)inf->rx_pkt.data;
+  DECLARE_BITMAP(val, X8H7_GPIO_NUM);
+  uint64_t                 m;
+
+  bitmap_to_arr64(&m, mask, X8H7_GPIO_NUM);
+  DBG_PRINT("mask: %09llX\n", m);
+
+  /* Only ask H7 for inputs without a pushed state */
+  spin_lock(&inf->val_lock);
+  m &= ~((inf->gpio_dir & ~inf->gpio_od) | inf->in_valid);
+  spin_unlock(&inf->val_lock);
+  if (!m) {
+    goto out;
+  }
+
+  x8h7_pkt_send_sync(X8H7_GPIO_PERIPH, X8H7_GPIO_OC_RD_MULTI, sizeof(m), &m);
+  if (x8h7_gpio_pkt_get(inf) < 0)
+    return -ETIMEDOUT;
+
+  if ((inf->rx_pkt.peripheral != X8H7_GPIO_PERIPH) ||
+      (inf->rx_pkt.opcode != X8H7_GPIO_OC_RD_MULTI) ||
+      (inf->rx_pkt.size != sizeof(*rsp))) {
+    return -EIO;
+  }
+  spin_lock(&inf->val_lock);
+  m &= rsp->mask;
+  inf->gpio_val = (inf->gpio_val & ~m) | (rsp->val & m);
+  spin_unlock(&inf->val_lock);
+
+out:
+  /* 64 bit shadow, snapshot it whole */
+  spin_lock(&inf->val_lock);
+  m = inf->gpio_val;
+  spin_unlock(&inf->val_lock);
+  bitmap_from_arr64(val, &m, X8H7_GPIO_NUM);
+  bitmap_replace(bits, bits, val, mask, X8H7_GPIO_NUM);
+  DBG_PRINT("read %09llX\n", m);
+  return 0;
 }
 
 static int x8h7_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
@@ -273,7 +455,7 @@ static int x8h7_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
   struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
 
   DBG_PRINT("offset: %d\n", offset);
-  if (inf->gpio_dir & (1 << offset)) {
+  if (inf->gpio_dir & BIT_ULL(offset)) {
     return GPIOF_DIR_OUT;
   }
   return GPIOF_DIR_IN;
@@ -283,7 +465,7 @@ static int x8h7_gpio_get_direction(struct gpio_chip *chip, unsigned offset)
 static int x8h7_gpio_set_config(struct gpio_chip *chip, unsigned int offset,
                                 unsigned long config)
 {
-//  struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
+  struct x8h7_gpio_info  *inf = gpiochip_get_data(chip);
   uint8_t                 data[2];
 
   DBG_PRINT("offset: %d, config: %ld\n", offset, config);
@@ -291,9 +473,15 @@ static int x8h7_gpio_set_config(struct gpio_chip *chip, unsigned int offset,
   switch (pinconf_to_config_param(config)) {
   case PIN_CONFIG_DRIVE_OPEN_DRAIN:
     data[1] = GPIO_MODE_OUTPUT_OD;
+    spin_lock(&inf->val_lock);
+    inf->gpio_od |= BIT_ULL(offset);
+    spin_unlock(&inf->val_lock);
     break;
   case PIN_CONFIG_DRIVE_PUSH_PULL:
     data[1] = GPIO_MODE_OUTPUT_PP;
+    spin_lock(&inf->val_lock);
+    inf->gpio_od &= ~BIT_ULL(offset);
+    spin_unlock(&inf->val_lock);
     break;
   default:
     return -ENOTSUPP;
@@ -569,6 +757,7 @@ static int x8h7_gpio_probe(struct platform_device *pdev)
   inf->tx_cnt = 0;
 
   mutex_init(&inf->lock);
+  spin_lock_init(&inf->val_lock);
 
   INIT_WORK(&inf->work, gpio_irq_work_func);
   inf->workqueue = create_workqueue("x8h7_gpio_irq_work");
@@ -604,6 +793,8 @@ static int x8h7_gpio_probe(struct platform_device *pdev)
   inf->gc.get              = x8h7_gpio_get;
   inf->gc.direction_output = x8h7_gpio_direction_output;
   inf->gc.set              = x8h7_gpio_set;
+  inf->gc.get_multiple     = x8h7_gpio_get_multiple;
+  inf->gc.set_multiple     = x8h7_gpio_set_multiple;
   inf->gc.get_direction    = x8h7_gpio_get_direction;
   inf->gc.set_config       = x8h7_gpio_set_config;
   inf->gc.to_irq           = x8h7_gpio_to_irq;
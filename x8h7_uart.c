@@ -16,6 +16,10 @@
 #include <linux/serial.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <asm/io.h>
 #include <asm/irq.h>
 
@@ -32,14 +36,20 @@
 #define X8H7_UART_BAUD_MIN          0
 #define X8H7_UART_BAUD_MAX    2000000
 
-// Peripheral code
+// Peripheral code, default for ports without "periph" DT property
 #define X8H7_UART_PERIPH 0x05
 
 // Op code
 #define X8H7_UART_OC_CONFIGURE      0x10 // BAUD | DATA_MODE 2 byte
+#define X8H7_UART_OC_RS485          0x11 // struct uartRs485Packet
+#define X8H7_UART_OC_RX_TIMING      0x12 // struct uartRxTimingPacket
 #define X8H7_UART_OC_GET_LINESTATE  0x20 // 2 byte
 #define X8H7_UART_OC_DATA           0x01 // variable
 #define X8H7_UART_OC_STATUS         0x02 // received uart status e.g. busy state
+#define X8H7_UART_OC_DATA_ERR       0x03 // error flags + data, flags refer to last byte
+#define X8H7_UART_OC_MCTRL          0x04 // modem input lines changed, 1 byte X8H7_UART_CTRL_*
+#define X8H7_UART_OC_XCHAR          0x05 // 1 byte, sent ahead of H7 TX buffer
+#define X8H7_UART_OC_BREAK          0x06 // 1 byte, 1 start break, 0 stop break
 
 // byte size
 #define X8H7_UART_CFG_BS_5  0x0001
@@ -70,10 +80,48 @@
 #define X8H7_UART_CTRL_DSR    0x0010
 #define X8H7_UART_CTRL_CTS    0x0020
 #define X8H7_UART_CTRL_DCD    0x0040
+#define X8H7_UART_CTRL_RI     0x0080
+
+// rx aggregation defaults
+#define X8H7_UART_RX_TIMEOUT_US_DEF  1000
+#define X8H7_UART_RX_TIMEOUT_US_MAX  65535
+#define X8H7_UART_RX_THRESHOLD_DEF   X8H7_PKT_SIZE
+
+// tx coalescing window, disabled by default
+#define X8H7_UART_TX_FLUSH_US_DEF    0
+#define X8H7_UART_TX_FLUSH_US_MAX    100000
+#define X8H7_UART_TX_FLUSH_BYTES_DEF X8H7_PKT_SIZE
+
+// out of tx credits, poll H7 status until it has room again
+#define X8H7_UART_CREDIT_POLL_US     1000
+
+// rs485 flags
+#define X8H7_UART_RS485_ENABLED         0x01
+#define X8H7_UART_RS485_RTS_ON_SEND     0x02
+#define X8H7_UART_RS485_RTS_AFTER_SEND  0x04
+#define X8H7_UART_RS485_RX_DURING_TX    0x08
 
 // uart status
 #define X8H7_UART_STATUS_TX_EMPTY  0x01
 
+// uart rx errors
+#define X8H7_UART_RX_ERR_OVERRUN   0x01
+#define X8H7_UART_RX_ERR_PARITY    0x02
+#define X8H7_UART_RX_ERR_FRAMING   0x04
+#define X8H7_UART_RX_ERR_BREAK     0x08
+
+/*
+ * X8H7_UART_OC_STATUS payload: status byte, optionally followed by the
+ * free space in the H7 TX buffer and the number of bytes the H7 received
+ * since the last X8H7_UART_OC_CONFIGURE. Bytes still in flight are the
+ * difference between what we sent and what the H7 received.
+ */
+struct __attribute__((packed)) uartStatusPacket {
+  uint8_t  status;
+  uint16_t tx_free;
+  uint32_t rx_total;
+};
+
 enum UARTParity {
   PARITY_EVEN = 0,
   PARITY_ODD,
@@ -89,6 +137,25 @@ struct __attribute__((packed, aligned(4))) uartPacket {
 };
 // 32-9 MSB 8 7-6 5-4 3-0 LSB
 
+/*
+ * H7 pushes received bytes after timeout_us of line idle or as soon as
+ * threshold bytes are buffered, whichever comes first.
+ */
+struct __attribute__((packed)) uartRxTimingPacket {
+  uint16_t timeout_us;
+  uint16_t threshold;
+};
+
+/*
+ * RS-485 half duplex: H7 drives DE (RTS) around each transmission,
+ * delays in ms.
+ */
+struct __attribute__((packed)) uartRs485Packet {
+  uint8_t  flags;
+  uint16_t delay_rts_before_send;
+  uint16_t delay_rts_after_send;
+};
+
 #define to_x8h7_uart_port(_port) \
                 container_of(_port, struct x8h7_uart_port, port)
 
@@ -97,45 +164,84 @@ struct __attribute__((packed, aligned(4))) uartPacket {
 #define X8H7_UART_MAJOR   204
 #define MINOR_START         5
 
-#define X8H7_UART_NR_PORTS  1
+#define X8H7_UART_NR_PORTS  4
 
 
-#define X8H7_UART_CFG_SEND  0x00000001
-#define X8H7_UART_TRANSMIT  0x00000002
+/* Bit numbers in x8h7_uart_port.flags, always changed with atomic bitops */
+#define X8H7_UART_CFG_SEND    0
+#define X8H7_UART_TRANSMIT    1
+#define X8H7_UART_STATUS_REQ  2
+#define X8H7_UART_CREDIT      3  // H7 advertises TX credits
+#define X8H7_UART_MCTRL_SEND  4
+#define X8H7_UART_RS485_SEND  5
+#define X8H7_UART_RXTIM_SEND  6
+#define X8H7_UART_XCHAR_SEND  7
+#define X8H7_UART_BREAK_SEND  8
+#define X8H7_UART_BREAK_START 9  // break started since last BREAK_SEND
 
 /*
- * This determines how often we check the modem status signals
- * for any change.  They generally aren't connected to an IRQ
- * so we have to poll them.  We also check immediately before
- * filling the TX fifo in case CTS has been dropped.
+ * Modem input lines until the H7 reports them, firmware without
+ * X8H7_UART_OC_MCTRL never does.
  */
-#define MCTRL_TIMEOUT	(250*HZ/1000)
+#define X8H7_UART_MCTRL_DEF   (TIOCM_DSR | TIOCM_CAR | TIOCM_CTS)
 
 struct x8h7_uart_port {
   struct uart_port          port;
-  struct timer_list         timer;
+  uint8_t                   periph;
+  unsigned int              mctrl;        // modem input lines pushed by H7
   unsigned int              old_status;
 
   /* Low level I/O work */
   struct work_struct        work;
   struct workqueue_struct  *workqueue;
-  uint32_t                  flags;
+  unsigned long             flags;
 
   struct uartPacket         cfg;
+  struct uartRs485Packet    rs485;
+  struct uartRxTimingPacket rx_timing;
+  uint16_t                  rx_timeout_us;  // user setting, ignored with UPF_LOW_LATENCY
+  uint16_t                  rx_threshold;
+  uint16_t                  control;
+  uint8_t                   break_state;
+
+  /* High priority char (XON/XOFF), queued by x8h7_uart_tx_chars */
+  uint8_t                   x_char;
+  ktime_t                   x_char_time;
+  unsigned int              x_char_cnt;
+  unsigned int              x_char_last_us;
+  unsigned int              x_char_max_us;
 
   /* X8H7 */
   wait_queue_head_t         wait;
   int                       rx_cnt;
-  x8h7_pkt_t                rx_pkt;
   uint8_t                   status; // used to handle busy tx and other stuff
+
+  /* TX coalescing, wait up to tx_flush_us or tx_flush_bytes */
+  struct hrtimer            tx_timer;
+  unsigned int              tx_flush_us;
+  unsigned int              tx_flush_bytes;
+
+  /* TX credits, valid with X8H7_UART_CREDIT */
+  uint16_t                  h7_tx_free;
+  uint32_t                  h7_rx_total;
+  uint32_t                  tx_total;
+
+  /* Bumped on xmit buffer flush, port lock held */
+  unsigned int              xmit_gen;
+
+  struct dentry            *dbgfs;
 };
 
 struct x8h7_uart_port x8h7_uart_ports[X8H7_UART_NR_PORTS];
+static unsigned long  x8h7_uart_ports_used;
+static DEFINE_MUTEX(x8h7_uart_ports_lock);
 
 static void x8h7_uart_stop_tx(struct uart_port *port);
-static void x8h7_uart_mctrl_check(struct x8h7_uart_port *sport);
-static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport);
+static void x8h7_uart_modem_status(struct x8h7_uart_port *sport, uint8_t ctrl);
+static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport,
+                               const uint8_t *data, int size, uint8_t err);
 static void x8h7_uart_tx_chars(struct x8h7_uart_port *sport);
+static void x8h7_uart_status(struct x8h7_uart_port *sport, x8h7_pkt_t *pkt);
 
 
 /**
@@ -144,47 +250,158 @@ static void x8h7_uart_hook(void *priv, x8h7_pkt_t *pkt)
 {
   struct x8h7_uart_port  *sport = (struct x8h7_uart_port*)priv;
 
-  memcpy(&sport->rx_pkt, pkt, sizeof(x8h7_pkt_t));
-
-  switch(sport->rx_pkt.opcode) {
+  switch(pkt->opcode) {
   case X8H7_UART_OC_DATA:
     /* Byte or break signal received */
-    x8h7_uart_rx_chars(sport);
+    x8h7_uart_rx_chars(sport, pkt->data, pkt->size, 0);
+    break;
+  case X8H7_UART_OC_DATA_ERR:
+    if (pkt->size >= 1) {
+      x8h7_uart_rx_chars(sport, pkt->data + 1, pkt->size - 1, pkt->data[0]);
+    }
     break;
   case X8H7_UART_OC_STATUS:
-    sport->status = sport->rx_pkt.data[0]; // @TODO: implement this on H7 side
+    x8h7_uart_status(sport, pkt);
+    break;
+  case X8H7_UART_OC_MCTRL:
+    if (pkt->size >= 1) {
+      x8h7_uart_modem_status(sport, pkt->data[0]);
+    }
     break;
   }
 
   sport->rx_cnt++;
 }
 
+/**
+ * Bytes the H7 can still accept, negative if the H7 does not advertise
+ * credits. Called with port lock held.
+ */
+static int x8h7_uart_tx_credit(struct x8h7_uart_port *sport)
+{
+  uint32_t inflight;
+
+  if (!test_bit(X8H7_UART_CREDIT, &sport->flags)) {
+    return -1;
+  }
+  inflight = sport->tx_total - sport->h7_rx_total;
+  if (inflight >= sport->h7_tx_free) {
+    return 0;
+  }
+  return sport->h7_tx_free - inflight;
+}
+
 /**
  */
-static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport)
+static void x8h7_uart_status(struct x8h7_uart_port *sport, x8h7_pkt_t *pkt)
 {
-  unsigned int  ch;
-  int           i;
-  int           ret;
+  struct uartStatusPacket  *sts = (struct uartStatusPacket *)pkt->data;
+  unsigned long             flags;
+
+  if (pkt->size < 1) {
+    return;
+  }
 
-  DBG_PRINT("size: %d\n", sport->rx_pkt.size);
-  for (i=0 ; i<sport->rx_pkt.size; i++) {
-    ch = sport->rx_pkt.data[0 + i];
-    ret = uart_handle_sysrq_char(&sport->port, ch);
-    if (!ret) {
-      // @TODO: fix parameters
-      unsigned int status = 0;
-      unsigned int overrun = 0;
-      unsigned int flg = TTY_NORMAL;
-      DBG_PRINT("add char '%c'\n", ch);
-      uart_insert_char(&sport->port, status, overrun, ch, flg);
-      sport->port.icount.rx++;
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->status = sts->status;
+  if (pkt->size >= sizeof(struct uartStatusPacket)) {
+    sport->h7_tx_free  = sts->tx_free;
+    sport->h7_rx_total = sts->rx_total;
+    set_bit(X8H7_UART_CREDIT, &sport->flags);
+    DBG_PRINT("status %02X free %d inflight %d\n", sport->status,
+              sport->h7_tx_free, sport->tx_total - sport->h7_rx_total);
+    /* Resume TX stalled on credits */
+    if (!uart_circ_empty(&sport->port.state->xmit) &&
+        (x8h7_uart_tx_credit(sport) > 0)) {
+      set_bit(X8H7_UART_TRANSMIT, &sport->flags);
+      queue_work(sport->workqueue, &sport->work);
     }
   }
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+}
 
-  //spin_unlock(&sport->port.lock);
-  tty_flip_buffer_push(&sport->port.state->port);
-  //spin_lock(&sport->port.lock);
+/**
+ */
+static bool x8h7_uart_sysrq_armed(struct uart_port *port)
+{
+#ifdef CONFIG_MAGIC_SYSRQ_SERIAL
+  return port->sysrq != 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Push received bytes to the tty layer. err holds X8H7_UART_RX_ERR_*
+ * flags reported by the H7 for the last byte of the packet.
+ */
+static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport,
+                               const uint8_t *data, int size, uint8_t err)
+{
+  struct uart_port  *port = &sport->port;
+  unsigned int       ch;
+  unsigned int       flg;
+  unsigned int       status;
+  int                i;
+
+  DBG_PRINT("size: %d err: %02X\n", size, err);
+
+  /* Fast path: whole payload in one go */
+  if (!err && !x8h7_uart_sysrq_armed(port)) {
+    i = tty_insert_flip_string(&port->state->port, data, size);
+    port->icount.rx += size;
+    /* No room in tty buffer, bytes are lost on the host side */
+    port->icount.buf_overrun += size - i;
+    tty_flip_buffer_push(&port->state->port);
+    return;
+  }
+
+  /* Break without data is reported as a NUL character */
+  if (size == 0) {
+    data = (const uint8_t *)"";
+    size = 1;
+  }
+
+  for (i = 0; i < size; i++) {
+    ch = data[i];
+    flg = TTY_NORMAL;
+    status = 0;
+    port->icount.rx++;
+
+    if ((i == size - 1) && err) {
+      /* Count all errors, report only the ones asked by termios */
+      if (err & X8H7_UART_RX_ERR_BREAK) {
+        port->icount.brk++;
+        if (uart_handle_break(port)) {
+          continue;
+        }
+      } else if (err & X8H7_UART_RX_ERR_PARITY) {
+        port->icount.parity++;
+      } else if (err & X8H7_UART_RX_ERR_FRAMING) {
+        port->icount.frame++;
+      }
+      if (err & X8H7_UART_RX_ERR_OVERRUN) {
+        port->icount.overrun++;
+      }
+
+      status = err & port->read_status_mask;
+      if (status & X8H7_UART_RX_ERR_BREAK) {
+        flg = TTY_BREAK;
+      } else if (status & X8H7_UART_RX_ERR_PARITY) {
+        flg = TTY_PARITY;
+      } else if (status & X8H7_UART_RX_ERR_FRAMING) {
+        flg = TTY_FRAME;
+      }
+    }
+
+    if (uart_handle_sysrq_char(port, ch)) {
+      continue;
+    }
+    DBG_PRINT("add char '%c'\n", ch);
+    uart_insert_char(port, status, X8H7_UART_RX_ERR_OVERRUN, ch, flg);
+  }
+
+  tty_flip_buffer_push(&port->state->port);
 }
 
 /**
@@ -192,40 +409,69 @@ static void x8h7_uart_rx_chars(struct x8h7_uart_port *sport)
 static void x8h7_uart_tx_chars(struct x8h7_uart_port *sport)
 {
   struct circ_buf  *xmit = &sport->port.state->xmit;
+  unsigned int      pending;
 
-#if 0
-  //@TODO Xon Xoff protocol
-  size = 0;
-
+  /* XON/XOFF goes out even when TX is stopped, ahead of queued data */
   if (sport->port.x_char) {
-    data[size] = sport->port.x_char;
-    size++;
-    sport->port.icount.tx++;
+    sport->x_char      = sport->port.x_char;
+    sport->x_char_time = ktime_get();
     sport->port.x_char = 0;
-    return;
+    set_bit(X8H7_UART_XCHAR_SEND, &sport->flags);
+    queue_work(sport->workqueue, &sport->work);
   }
-#endif
-  /*
-   * Check the modem control lines before
-   * transmitting anything.
-   */
-  x8h7_uart_mctrl_check(sport);
 
   if (uart_circ_empty(xmit) || uart_tx_stopped(&sport->port)) {
     x8h7_uart_stop_tx(&sport->port);
     return;
   }
 
+  /*
+   * Few bytes from an idle port: wait for more to fill the SPI frame.
+   * Flush at once when the window is off, enough bytes are pending,
+   * the buffer is filling up or a transfer is already going on.
+   * A pending x_char takes the data along.
+   */
+  pending = uart_circ_chars_pending(xmit);
+  if (sport->tx_flush_us &&
+      (pending < sport->tx_flush_bytes) &&
+      (pending < UART_XMIT_SIZE / 2) &&
+      !test_bit(X8H7_UART_TRANSMIT, &sport->flags) &&
+      !test_bit(X8H7_UART_XCHAR_SEND, &sport->flags)) {
+    if (!hrtimer_active(&sport->tx_timer)) {
+      hrtimer_start(&sport->tx_timer, us_to_ktime(sport->tx_flush_us),
+                    HRTIMER_MODE_REL);
+    }
+    return;
+  }
+  hrtimer_try_to_cancel(&sport->tx_timer);
+
   /*
    * TX while bytes available
    */
-  sport->flags |= X8H7_UART_TRANSMIT;
+  set_bit(X8H7_UART_TRANSMIT, &sport->flags);
   DBG_PRINT("work queue triggered\n");
   queue_work(sport->workqueue, &sport->work);
 }
 
+/**
+ * TX coalescing window expired, send what we have
+ */
+static enum hrtimer_restart x8h7_uart_tx_timer(struct hrtimer *t)
+{
+  struct x8h7_uart_port *sport = container_of(t, struct x8h7_uart_port, tx_timer);
+  unsigned long          flags;
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  set_bit(X8H7_UART_TRANSMIT, &sport->flags);
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+  queue_work(sport->workqueue, &sport->work);
+
+  return HRTIMER_NORESTART;
+}
+
 /**
  * Handle any change of modem status signal since we were last called.
+ * Called with port lock held.
  */
 static void x8h7_uart_mctrl_check(struct x8h7_uart_port *sport)
 {
@@ -251,15 +497,37 @@ static void x8h7_uart_mctrl_check(struct x8h7_uart_port *sport)
   if (changed & TIOCM_CTS) {
     uart_handle_cts_change(&sport->port, status & TIOCM_CTS);
   }
+  wake_up_interruptible(&sport->port.state->port.delta_msr_wait);
 }
 
 /**
- * This is our per-port timeout handler, for checking the
- * modem status signals: RI DSR CAR CTS.
+ * Modem input lines changed on H7 side, ctrl holds X8H7_UART_CTRL_* bits.
+ * No polling: TIOCMIWAIT waiters are woken from here.
  */
-/*static void x8h7_uart_timeout(struct timer_list *t)
+static void x8h7_uart_modem_status(struct x8h7_uart_port *sport, uint8_t ctrl)
 {
-}*/
+  unsigned long flags;
+  unsigned int  mctrl = 0;
+
+  if (ctrl & X8H7_UART_CTRL_CTS) {
+    mctrl |= TIOCM_CTS;
+  }
+  if (ctrl & X8H7_UART_CTRL_DSR) {
+    mctrl |= TIOCM_DSR;
+  }
+  if (ctrl & X8H7_UART_CTRL_DCD) {
+    mctrl |= TIOCM_CAR;
+  }
+  if (ctrl & X8H7_UART_CTRL_RI) {
+    mctrl |= TIOCM_RI;
+  }
+  DBG_PRINT("modem lines %02X\n", ctrl);
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->mctrl = mctrl;
+  x8h7_uart_mctrl_check(sport);
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+}
 
 /**
  * Stop receiving - port is in process of being closed.
@@ -272,23 +540,41 @@ static void x8h7_uart_stop_rx(struct uart_port *port)
 
 /**
  * Return TIOCSER_TEMT when transmitter is not busy.
- * @TODO: need to understand when H7 is still busy
- * in trasmitting data on uart due to slower throughput in
- * comparison with spi. Introduce status byte?
+ * With TX credits the H7 status tells when all the bytes we sent
+ * left its UART, every call asks for a fresh status.
  */
 static unsigned int x8h7_uart_tx_empty(struct uart_port *port)
 {
   struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
-  DBG_PRINT("Tx empty : %x\n", sport->flags);
+  unsigned long           flags;
+  unsigned int            ret;
+
+  DBG_PRINT("Tx empty : %lx\n", sport->flags);
+  spin_lock_irqsave(&sport->port.lock, flags);
+  ret = TIOCSER_TEMT;
+  if (test_bit(X8H7_UART_TRANSMIT, &sport->flags)) {
+    ret = 0;
+  } else if (test_bit(X8H7_UART_CREDIT, &sport->flags)) {
+    if (!uart_circ_empty(&sport->port.state->xmit) ||
+        (sport->tx_total != sport->h7_rx_total) ||
+        !(sport->status & X8H7_UART_STATUS_TX_EMPTY)) {
+      ret = 0;
+    }
+  }
+  if (!ret) {
+    set_bit(X8H7_UART_STATUS_REQ, &sport->flags);
+  }
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+
   queue_work(sport->workqueue, &sport->work);
-  return ((sport->flags & X8H7_UART_TRANSMIT) ? 0 : TIOCSER_TEMT);
+  return ret;
 }
 
 /**
  */
 static void x8h7_uart_set_mctrl(struct uart_port *port, unsigned int mctrl)
 {
-//struct x8h7_uart_port  *sport = (struct x8h7_uart_port *)port;
+  struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
   uint16_t                control;
 
   DBG_PRINT("x8h7_uart_set_mctrl\n");
@@ -303,19 +589,73 @@ static void x8h7_uart_set_mctrl(struct uart_port *port, unsigned int mctrl)
   if (mctrl & TIOCM_DTR) {
     control |= X8H7_UART_CTRL_DTR;
   }
-//@TODO: tolto per BUG: scheduling while atomic: insmod/573/0x00000002 trovare un sistema
-  //x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_GET_LINESTATE, 2, &control);
+  /* Called in atomic context, send it from x8h7_uart_work_func */
+  sport->control = control;
+  set_bit(X8H7_UART_MCTRL_SEND, &sport->flags);
+  queue_work(sport->workqueue, &sport->work);
 }
 
+/**
+ * Configure RS-485 half duplex, DE is driven by H7 with the requested
+ * delays so turnaround does not need a host round trip.
+ * Called in atomic context, send it from x8h7_uart_work_func
+ */
+static int x8h7_uart_rs485_config(struct uart_port *port,
+                                  struct ktermios *termios,
+                                  struct serial_rs485 *rs485)
+{
+  struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
+
+  DBG_PRINT("flags %08X before %d after %d\n", rs485->flags,
+            rs485->delay_rts_before_send, rs485->delay_rts_after_send);
+
+  sport->rs485.flags = 0;
+  if (rs485->flags & SER_RS485_ENABLED) {
+    sport->rs485.flags |= X8H7_UART_RS485_ENABLED;
+    sport->control |= X8H7_UART_CTRL_RS485;
+  } else {
+    sport->control &= ~X8H7_UART_CTRL_RS485;
+  }
+  if (rs485->flags & SER_RS485_RTS_ON_SEND) {
+    sport->rs485.flags |= X8H7_UART_RS485_RTS_ON_SEND;
+  }
+  if (rs485->flags & SER_RS485_RTS_AFTER_SEND) {
+    sport->rs485.flags |= X8H7_UART_RS485_RTS_AFTER_SEND;
+  }
+  if (rs485->flags & SER_RS485_RX_DURING_TX) {
+    sport->rs485.flags |= X8H7_UART_RS485_RX_DURING_TX;
+  }
+  sport->rs485.delay_rts_before_send = rs485->delay_rts_before_send;
+  sport->rs485.delay_rts_after_send  = rs485->delay_rts_after_send;
+
+  set_bit(X8H7_UART_RS485_SEND, &sport->flags);
+  set_bit(X8H7_UART_MCTRL_SEND, &sport->flags);
+  queue_work(sport->workqueue, &sport->work);
+
+  return 0;
+}
+
+static const struct serial_rs485 x8h7_uart_rs485_supported = {
+  .flags                 = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND |
+                           SER_RS485_RTS_AFTER_SEND | SER_RS485_RX_DURING_TX,
+  .delay_rts_before_send = 1,
+  .delay_rts_after_send  = 1,
+};
+
 /**
  */
 static unsigned int x8h7_uart_get_mctrl(struct uart_port *port)
 {
-  /* DCD and DSR are not wired and CTS/RTS is handled automatically
-  * so just indicate DSR and CAR asserted
-  * @TODO: add also TIOCM_CTS?
-  */
-  return TIOCM_DSR | TIOCM_CAR;
+  struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
+
+  return sport->mctrl;
+}
+
+/**
+ * H7 always reports modem line changes, nothing to enable
+ */
+static void x8h7_uart_enable_ms(struct uart_port *port)
+{
 }
 
 /**
@@ -337,6 +677,19 @@ static void x8h7_uart_start_tx(struct uart_port *port)
   x8h7_uart_tx_chars(sport);
 }
 
+/**
+ * The serial core cleared the xmit buffer, a TX copy in progress
+ * must not move the tail anymore. Called with port lock held.
+ */
+static void x8h7_uart_flush_buffer(struct uart_port *port)
+{
+  struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
+
+  DBG_PRINT("x8h7_uart_flush_buffer\n");
+  sport->xmit_gen++;
+  hrtimer_try_to_cancel(&sport->tx_timer);
+}
+
 /**
  * Control the transmission of a break signal
  */
@@ -345,9 +698,15 @@ static void x8h7_uart_break_ctl(struct uart_port *port, int break_state)
   struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
   unsigned long           flags;
 
-  DBG_PRINT("x8h7_uart_break_ctl\n");
+  DBG_PRINT("x8h7_uart_break_ctl %d\n", break_state);
   spin_lock_irqsave(&sport->port.lock, flags);
+  sport->break_state = break_state ? 1 : 0;
+  if (break_state) {
+    set_bit(X8H7_UART_BREAK_START, &sport->flags);
+  }
+  set_bit(X8H7_UART_BREAK_SEND, &sport->flags);
   spin_unlock_irqrestore(&sport->port.lock, flags);
+  queue_work(sport->workqueue, &sport->work);
 }
 
 /**
@@ -358,8 +717,7 @@ static int x8h7_uart_request_port(struct uart_port *port)
   struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
 
   DBG_PRINT("\n");
-  x8h7_hook_set(X8H7_UART_PERIPH, x8h7_uart_hook, sport);
-  return 0;
+  return x8h7_hook_set(sport->periph, x8h7_uart_hook, sport);
 }
 
 /**
@@ -367,8 +725,10 @@ static int x8h7_uart_request_port(struct uart_port *port)
  */
 static void x8h7_uart_release_port(struct uart_port *port)
 {
+  struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
+
   DBG_PRINT("\n");
-  x8h7_hook_set(X8H7_UART_PERIPH, NULL, NULL);
+  x8h7_hook_set(sport->periph, NULL, NULL);
 }
 
 /**
@@ -383,6 +743,10 @@ static int x8h7_uart_startup(struct uart_port *port)
   res = x8h7_uart_request_port(port);
   if (res == 0) {
     sport->port.type = PORT_X8H7_UART;
+    /* RS-485 enabled from device tree */
+    if (port->rs485.flags & SER_RS485_ENABLED) {
+      x8h7_uart_rs485_config(port, NULL, &port->rs485);
+    }
   }
   else {
     sport->port.type = 150;
@@ -400,6 +764,7 @@ static void x8h7_uart_shutdown(struct uart_port *port)
   struct x8h7_uart_port *sport = to_x8h7_uart_port(port);
 
   DBG_PRINT("\n");
+  hrtimer_cancel(&sport->tx_timer);
   x8h7_uart_release_port(port);
   sport->port.type = 150;
   /*
@@ -409,6 +774,39 @@ static void x8h7_uart_shutdown(struct uart_port *port)
    */
 }
 
+/**
+ * Compute RX aggregation from user settings, ASYNC_LOW_LATENCY
+ * forces single byte latency.
+ */
+static void x8h7_uart_rx_timing(struct x8h7_uart_port *sport)
+{
+  if (sport->port.flags & UPF_LOW_LATENCY) {
+    sport->rx_timing.timeout_us = 0;
+    sport->rx_timing.threshold  = 1;
+  } else {
+    sport->rx_timing.timeout_us = sport->rx_timeout_us;
+    sport->rx_timing.threshold  = sport->rx_threshold;
+  }
+  set_bit(X8H7_UART_RXTIM_SEND, &sport->flags);
+}
+
+/**
+ * Worst case delay between a lone byte reaching the H7 and the H7
+ * pushing it: one character time plus the idle timeout.
+ */
+static unsigned int x8h7_uart_rx_latency_us(struct x8h7_uart_port *sport)
+{
+  unsigned int char_us = 0;
+
+  if (sport->cfg.baud) {
+    char_us = DIV_ROUND_UP(10 * USEC_PER_SEC, sport->cfg.baud);
+  }
+  if (sport->rx_timing.threshold == 1) {
+    return char_us;
+  }
+  return char_us + sport->rx_timing.timeout_us;
+}
+
 /**
  * Change the port parameters
  */
@@ -417,6 +815,7 @@ static void x8h7_uart_set_termios(struct uart_port *port,
                                   const struct ktermios *old)
 {
   struct x8h7_uart_port  *sport = to_x8h7_uart_port(port);
+  unsigned long           flags;
   unsigned int            baud;
 
   memset(&sport->cfg, 0, sizeof(sport->cfg));
@@ -486,6 +885,27 @@ static void x8h7_uart_set_termios(struct uart_port *port,
     sport->cfg.parity = PARITY_NONE;
   }
 
+  /* rx errors to report and to ignore */
+  spin_lock_irqsave(&port->lock, flags);
+  port->read_status_mask = X8H7_UART_RX_ERR_OVERRUN;
+  if (termios->c_iflag & INPCK) {
+    port->read_status_mask |= X8H7_UART_RX_ERR_PARITY | X8H7_UART_RX_ERR_FRAMING;
+  }
+  if (termios->c_iflag & (IGNBRK | BRKINT | PARMRK)) {
+    port->read_status_mask |= X8H7_UART_RX_ERR_BREAK;
+  }
+  port->ignore_status_mask = 0;
+  if (termios->c_iflag & IGNPAR) {
+    port->ignore_status_mask |= X8H7_UART_RX_ERR_PARITY | X8H7_UART_RX_ERR_FRAMING;
+  }
+  if (termios->c_iflag & IGNBRK) {
+    port->ignore_status_mask |= X8H7_UART_RX_ERR_BREAK;
+    if (termios->c_iflag & IGNPAR) {
+      port->ignore_status_mask |= X8H7_UART_RX_ERR_OVERRUN;
+    }
+  }
+  spin_unlock_irqrestore(&port->lock, flags);
+
   /* baud */
   baud = uart_get_baud_rate(port, termios, old,
                             X8H7_UART_BAUD_MIN, X8H7_UART_BAUD_MAX);
@@ -498,7 +918,8 @@ static void x8h7_uart_set_termios(struct uart_port *port,
    * then, disable everything
    * Reset the Rx and Tx FIFOs too
    */
-  sport->flags |= X8H7_UART_CFG_SEND;
+  set_bit(X8H7_UART_CFG_SEND, &sport->flags);
+  x8h7_uart_rx_timing(sport);
   DBG_PRINT("work queue triggered\n");
   queue_work(sport->workqueue, &sport->work);
 
@@ -556,12 +977,291 @@ static int x8h7_uart_verify_port(struct uart_port *port,
   return 0;  //ret;
 }
 
+/**
+ */
+static struct x8h7_uart_port *x8h7_uart_dev_to_sport(struct device *dev)
+{
+  struct tty_port   *port = dev_get_drvdata(dev);
+  struct uart_state *state = container_of(port, struct uart_state, port);
+
+  return to_x8h7_uart_port(state->uart_port);
+}
+
+/**
+ * RX idle timeout show
+ */
+static ssize_t rx_timeout_us_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+
+  return snprintf(buf, PAGE_SIZE, "%d\n", sport->rx_timeout_us);
+}
+
+/**
+ * RX idle timeout set, 0 only with threshold 1: without the idle flush
+ * a burst shorter than the threshold would never be pushed
+ */
+static ssize_t rx_timeout_us_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t count)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+  unsigned long          flags;
+  unsigned int           val;
+
+  if (kstrtouint(buf, 0, &val) || (val > X8H7_UART_RX_TIMEOUT_US_MAX)) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  if ((val == 0) && (sport->rx_threshold > 1)) {
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    return -EINVAL;
+  }
+  sport->rx_timeout_us = val;
+  x8h7_uart_rx_timing(sport);
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+  queue_work(sport->workqueue, &sport->work);
+
+  return count;
+}
+
+/**
+ * RX push threshold show
+ */
+static ssize_t rx_threshold_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+
+  return snprintf(buf, PAGE_SIZE, "%d\n", sport->rx_threshold);
+}
+
+/**
+ * RX push threshold set, must be 1 while the idle timeout is 0
+ */
+static ssize_t rx_threshold_store(struct device *dev,
+                                  struct device_attribute *attr,
+                                  const char *buf, size_t count)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+  unsigned long          flags;
+  unsigned int           val;
+
+  if (kstrtouint(buf, 0, &val) || (val < 1) || (val > X8H7_PKT_SIZE)) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  if ((val > 1) && (sport->rx_timeout_us == 0)) {
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    return -EINVAL;
+  }
+  sport->rx_threshold = val;
+  x8h7_uart_rx_timing(sport);
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+  queue_work(sport->workqueue, &sport->work);
+
+  return count;
+}
+
+/**
+ * Effective RX latency show
+ */
+static ssize_t rx_latency_us_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+
+  return snprintf(buf, PAGE_SIZE, "%u\n", x8h7_uart_rx_latency_us(sport));
+}
+
+/**
+ * TX coalescing window show
+ */
+static ssize_t tx_flush_us_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+
+  return snprintf(buf, PAGE_SIZE, "%u\n", sport->tx_flush_us);
+}
+
+/**
+ * TX coalescing window set, 0 disables it
+ */
+static ssize_t tx_flush_us_store(struct device *dev,
+                                 struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+  unsigned long          flags;
+  unsigned int           val;
+
+  if (kstrtouint(buf, 0, &val) || (val > X8H7_UART_TX_FLUSH_US_MAX)) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->tx_flush_us = val;
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+
+  return count;
+}
+
+/**
+ * TX flush threshold show
+ */
+static ssize_t tx_flush_bytes_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+
+  return snprintf(buf, PAGE_SIZE, "%u\n", sport->tx_flush_bytes);
+}
+
+/**
+ * TX flush threshold set
+ */
+static ssize_t tx_flush_bytes_store(struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count)
+{
+  struct x8h7_uart_port *sport = x8h7_uart_dev_to_sport(dev);
+  unsigned long          flags;
+  unsigned int           val;
+
+  if (kstrtouint(buf, 0, &val) || (val < 1) || (val > UART_XMIT_SIZE)) {
+    return -EINVAL;
+  }
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->tx_flush_bytes = val;
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+
+  return count;
+}
+
+static DEVICE_ATTR_RW(rx_timeout_us);
+static DEVICE_ATTR_RW(rx_threshold);
+static DEVICE_ATTR_RO(rx_latency_us);
+static DEVICE_ATTR_RW(tx_flush_us);
+static DEVICE_ATTR_RW(tx_flush_bytes);
+
+static struct attribute *x8h7_uart_sysfs_attrs[] = {
+  &dev_attr_rx_timeout_us.attr,
+  &dev_attr_rx_threshold.attr,
+  &dev_attr_rx_latency_us.attr,
+  &dev_attr_tx_flush_us.attr,
+  &dev_attr_tx_flush_bytes.attr,
+  NULL,
+};
+
+static const struct attribute_group x8h7_uart_sysfs_attr_group = {
+  .attrs = x8h7_uart_sysfs_attrs,
+};
+
+/**
+ * Send pending x_char, if any, and account its latency.
+ * Called from x8h7_uart_work_func.
+ */
+static void x8h7_uart_xchar_send(struct x8h7_uart_port *sport)
+{
+  unsigned long flags;
+  unsigned int  us;
+  uint8_t       ch;
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  if (!test_and_clear_bit(X8H7_UART_XCHAR_SEND, &sport->flags)) {
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    return;
+  }
+  ch = sport->x_char;
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+
+  x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_XCHAR, 1, &ch);
+
+  us = ktime_us_delta(ktime_get(), sport->x_char_time);
+  spin_lock_irqsave(&sport->port.lock, flags);
+  sport->port.icount.tx++;
+  sport->x_char_cnt++;
+  sport->x_char_last_us = us;
+  if (us > sport->x_char_max_us) {
+    sport->x_char_max_us = us;
+  }
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+}
+
+/**
+ * Line quality statistics, same counters as TIOCGICOUNT plus
+ * transport state
+ */
+static int x8h7_uart_stats_show(struct seq_file *m, void *v)
+{
+  struct x8h7_uart_port  *sport = m->private;
+  struct uart_icount      icount;
+  unsigned long           flags;
+  int                     credit;
+  uint32_t                inflight;
+
+  spin_lock_irqsave(&sport->port.lock, flags);
+  icount   = sport->port.icount;
+  credit   = x8h7_uart_tx_credit(sport);
+  inflight = sport->tx_total - sport->h7_rx_total;
+  spin_unlock_irqrestore(&sport->port.lock, flags);
+
+  seq_printf(m,
+             "periph         %d\n"
+             "baud           %d\n"
+             "rx             %u\n"
+             "tx             %u\n"
+             "frame          %u\n"
+             "parity         %u\n"
+             "brk            %u\n"
+             "overrun        %u\n"
+             "buf_overrun    %u\n"
+             "cts            %u\n"
+             "dsr            %u\n"
+             "rng            %u\n"
+             "dcd            %u\n"
+             "tx credit      %d\n"
+             "tx in flight   %u\n"
+             "rx latency us  %u\n"
+             "x_char         %u\n"
+             "x_char last us %u\n"
+             "x_char max us  %u\n",
+             sport->periph,
+             sport->cfg.baud,
+             icount.rx,
+             icount.tx,
+             icount.frame,
+             icount.parity,
+             icount.brk,
+             icount.overrun,
+             icount.buf_overrun,
+             icount.cts,
+             icount.dsr,
+             icount.rng,
+             icount.dcd,
+             credit,
+             (credit < 0) ? 0 : inflight,
+             x8h7_uart_rx_latency_us(sport),
+             sport->x_char_cnt,
+             sport->x_char_last_us,
+             sport->x_char_max_us);
+  return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(x8h7_uart_stats);
+
 static const struct uart_ops x8h7_uart_pops = {
   .tx_empty     = x8h7_uart_tx_empty,
   .set_mctrl    = x8h7_uart_set_mctrl,
   .get_mctrl    = x8h7_uart_get_mctrl,
+  .enable_ms    = x8h7_uart_enable_ms,
   .stop_tx      = x8h7_uart_stop_tx,
   .start_tx     = x8h7_uart_start_tx,
+  .flush_buffer = x8h7_uart_flush_buffer,
   .stop_rx      = x8h7_uart_stop_rx,
   .break_ctl    = x8h7_uart_break_ctl,
   .startup      = x8h7_uart_startup,
@@ -590,36 +1290,115 @@ static struct uart_driver x8h7_uart = {
 static void x8h7_uart_work_func(struct work_struct *work)
 {
   struct x8h7_uart_port *sport = container_of(work, struct x8h7_uart_port, work);
+  unsigned long          flags;
 
   DBG_PRINT("work queue start\n");
-  DBG_PRINT("FLAGS %08X\n", sport->flags);
-
-  if (sport->flags & X8H7_UART_CFG_SEND) {
-    sport->flags &= ~X8H7_UART_CFG_SEND;
-    x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_CONFIGURE,
+  DBG_PRINT("FLAGS %08lX\n", sport->flags);
+
+  if (test_and_clear_bit(X8H7_UART_CFG_SEND, &sport->flags)) {
+    /* H7 restarts its byte count, credits are valid after next status */
+    spin_lock_irqsave(&sport->port.lock, flags);
+    clear_bit(X8H7_UART_CREDIT, &sport->flags);
+    sport->tx_total = 0;
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_CONFIGURE,
                        sizeof(sport->cfg), &sport->cfg);
   }
-  if (sport->flags & X8H7_UART_TRANSMIT) {
+  x8h7_uart_xchar_send(sport);
+  if (test_and_clear_bit(X8H7_UART_RXTIM_SEND, &sport->flags)) {
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_RX_TIMING,
+                       sizeof(sport->rx_timing), &sport->rx_timing);
+  }
+  if (test_and_clear_bit(X8H7_UART_RS485_SEND, &sport->flags)) {
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_RS485,
+                       sizeof(sport->rs485), &sport->rs485);
+  }
+  if (test_and_clear_bit(X8H7_UART_MCTRL_SEND, &sport->flags)) {
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_GET_LINESTATE,
+                       sizeof(sport->control), &sport->control);
+  }
+  if (test_bit(X8H7_UART_BREAK_SEND, &sport->flags)) {
+    uint8_t brk;
+    bool    started;
+
+    /* Clear and sample break_state together, a newer request requeues */
+    spin_lock_irqsave(&sport->port.lock, flags);
+    clear_bit(X8H7_UART_BREAK_SEND, &sport->flags);
+    started = test_and_clear_bit(X8H7_UART_BREAK_START, &sport->flags);
+    brk = sport->break_state;
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+    /* Break started and stopped before we got here, still send it */
+    if (started && !brk) {
+      uint8_t start = 1;
+
+      x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_BREAK, 1, &start);
+    }
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_BREAK, 1, &brk);
+  }
+  if (test_and_clear_bit(X8H7_UART_TRANSMIT, &sport->flags)) {
     struct circ_buf  *xmit = &sport->port.state->xmit;
-    uint8_t           txb[X8H7_PKT_SIZE];
     uint16_t          size;
-
-    sport->flags &= ~X8H7_UART_TRANSMIT;
+    uint16_t          size1;
+    unsigned int      tail;
+    unsigned int      gen;
+    int               credit;
 
     while (!uart_circ_empty(xmit)) {
+      /* x_char queued meanwhile overtakes the remaining data */
+      x8h7_uart_xchar_send(sport);
 
-      for (size = 0; size < X8H7_PKT_SIZE && !uart_circ_empty(xmit); size++) {
-        txb[size] = xmit->buf[xmit->tail];
-
-        xmit->tail = (xmit->tail + 1) & (UART_XMIT_SIZE - 1);
+      spin_lock_irqsave(&sport->port.lock, flags);
+      if (uart_tx_stopped(&sport->port)) {
+        spin_unlock_irqrestore(&sport->port.lock, flags);
+        break;
+      }
+      credit = x8h7_uart_tx_credit(sport);
+      size = min_t(int, uart_circ_chars_pending(xmit), X8H7_PKT_SIZE);
+      if (credit >= 0) {
+        size = min_t(int, size, credit);
+      }
+      /* Copy and tail update both work on this snapshot */
+      tail  = xmit->tail;
+      size1 = min_t(int, size, CIRC_CNT_TO_END(xmit->head, tail, UART_XMIT_SIZE));
+      sport->tx_total += size;
+      gen = sport->xmit_gen;
+      spin_unlock_irqrestore(&sport->port.lock, flags);
+      if (size == 0) {
+        /*
+         * H7 buffer full, ask for its status now: x8h7_uart_status
+         * resumes TX when it has room. If it has none yet, the timer
+         * retries TX later, which polls again.
+         */
+        DBG_PRINT("out of credits\n");
+        set_bit(X8H7_UART_STATUS_REQ, &sport->flags);
+        hrtimer_start(&sport->tx_timer, us_to_ktime(X8H7_UART_CREDIT_POLL_US),
+                      HRTIMER_MODE_REL);
+        break;
       }
 
-      //send pkt
-      x8h7_pkt_send_sync(X8H7_UART_PERIPH, X8H7_UART_OC_DATA, size, txb);
+      /* Copy once from circ_buf to SPI frame, in two chunks if it wraps */
+      x8h7_pkt_send_sync_sg(sport->periph, X8H7_UART_OC_DATA,
+                            size1, xmit->buf + tail,
+                            size - size1, xmit->buf);
 
+      spin_lock_irqsave(&sport->port.lock, flags);
+      /* Buffer flushed during the copy, tail was reset already */
+      if (gen == sport->xmit_gen) {
+        xmit->tail = (tail + size) & (UART_XMIT_SIZE - 1);
+      }
       sport->port.icount.tx += size;
+      spin_unlock_irqrestore(&sport->port.lock, flags);
     }
     //uart_circ_clear(xmit);
+
+    spin_lock_irqsave(&sport->port.lock, flags);
+    if (uart_circ_chars_pending(xmit) < WAKEUP_CHARS) {
+      uart_write_wakeup(&sport->port);
+    }
+    spin_unlock_irqrestore(&sport->port.lock, flags);
+  }
+  if (test_and_clear_bit(X8H7_UART_STATUS_REQ, &sport->flags)) {
+    x8h7_pkt_send_sync(sport->periph, X8H7_UART_OC_STATUS, 0, NULL);
   }
   DBG_PRINT("work queue end\n");
 }
@@ -628,46 +1407,127 @@ static void x8h7_uart_work_func(struct work_struct *work)
  */
 static int x8h7_uart_probe(struct platform_device *pdev)
 {
-  int i = 0;
-
-  init_waitqueue_head(&x8h7_uart_ports[i].wait);
-
-  x8h7_uart_ports[i].port.type     = 150;
-  x8h7_uart_ports[i].port.fifosize = 32;
-  x8h7_uart_ports[i].port.flags    = 0;
-  x8h7_uart_ports[i].port.iotype   = SERIAL_IO_PORT;
-  x8h7_uart_ports[i].port.iobase   = 0;
-  x8h7_uart_ports[i].port.membase  = (void __iomem *)~0;
-  x8h7_uart_ports[i].port.uartclk  = 24*1000*1000;
-  x8h7_uart_ports[i].port.ops      = &x8h7_uart_pops;
-
-  x8h7_uart_ports[i].port.line = 0;
-  x8h7_uart_ports[i].port.dev  = &pdev->dev;
-  x8h7_uart_ports[i].port.irq  = 0;
+  struct x8h7_uart_port  *sport;
+  uint32_t                periph;
+  char                    name[32];
+  int                     ret;
+  int                     i;
+
+  if (of_property_read_u32(pdev->dev.of_node, "portenta,periph", &periph)) {
+    periph = X8H7_UART_PERIPH;
+  }
+  if (periph >= X8H7_PERIPH_NUM) {
+    DBG_ERROR("invalid periph %u\n", periph);
+    return -EINVAL;
+  }
 
-  uart_add_one_port(&x8h7_uart, &x8h7_uart_ports[i].port);
-  platform_set_drvdata(pdev, &x8h7_uart_ports[i]);
-  x8h7_hook_set(X8H7_UART_PERIPH, x8h7_uart_hook, &x8h7_uart_ports[i]);
+  /* Each port needs its own H7 peripheral, take the first free line */
+  mutex_lock(&x8h7_uart_ports_lock);
+  for_each_set_bit(i, &x8h7_uart_ports_used, X8H7_UART_NR_PORTS) {
+    if (x8h7_uart_ports[i].periph == periph) {
+      mutex_unlock(&x8h7_uart_ports_lock);
+      DBG_ERROR("periph %u already used by line %d\n", periph, i);
+      return -EBUSY;
+    }
+  }
+  i = find_first_zero_bit(&x8h7_uart_ports_used, X8H7_UART_NR_PORTS);
+  if (i >= X8H7_UART_NR_PORTS) {
+    mutex_unlock(&x8h7_uart_ports_lock);
+    DBG_ERROR("no free uart port\n");
+    return -EBUSY;
+  }
+  sport = &x8h7_uart_ports[i];
+  sport->periph = periph;
+  set_bit(i, &x8h7_uart_ports_used);
+  mutex_unlock(&x8h7_uart_ports_lock);
+
+  init_waitqueue_head(&sport->wait);
+
+  sport->port.type     = 150;
+  sport->port.fifosize = 32;
+  sport->port.flags    = 0;
+  sport->port.iotype   = SERIAL_IO_PORT;
+  sport->port.iobase   = 0;
+  sport->port.membase  = (void __iomem *)~0;
+  sport->port.uartclk  = 24*1000*1000;
+  sport->port.ops      = &x8h7_uart_pops;
+  sport->port.rs485_config    = x8h7_uart_rs485_config;
+  sport->port.rs485_supported = x8h7_uart_rs485_supported;
+  sport->port.attr_group      = &x8h7_uart_sysfs_attr_group;
+
+  sport->rx_timeout_us  = X8H7_UART_RX_TIMEOUT_US_DEF;
+  sport->rx_threshold   = X8H7_UART_RX_THRESHOLD_DEF;
+  sport->mctrl          = X8H7_UART_MCTRL_DEF;
+  sport->old_status     = X8H7_UART_MCTRL_DEF;
+  sport->tx_flush_us    = X8H7_UART_TX_FLUSH_US_DEF;
+  sport->tx_flush_bytes = X8H7_UART_TX_FLUSH_BYTES_DEF;
+
+  hrtimer_init(&sport->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+  sport->tx_timer.function = x8h7_uart_tx_timer;
+
+  sport->port.line = i;
+  sport->port.dev  = &pdev->dev;
+  sport->port.irq  = 0;
+
+  ret = uart_get_rs485_mode(&sport->port);
+  if (ret) {
+    DBG_ERROR("invalid rs485 properties\n");
+    goto out_free_line;
+  }
 
-  INIT_WORK(&x8h7_uart_ports[i].work, x8h7_uart_work_func);
-  x8h7_uart_ports[i].workqueue = create_workqueue("x8h7_uart_work");
-  if (!x8h7_uart_ports[i].workqueue) {
+  INIT_WORK(&sport->work, x8h7_uart_work_func);
+  sport->workqueue = alloc_workqueue("x8h7_uart%d_work", WQ_MEM_RECLAIM, 1, i);
+  if (!sport->workqueue) {
     DBG_ERROR("fail to create work queue\n");
-    return -ENOMEM;
+    ret = -ENOMEM;
+    goto out_free_line;
   }
 
-  DBG_PRINT("probed\n");
+  ret = uart_add_one_port(&x8h7_uart, &sport->port);
+  if (ret) {
+    DBG_ERROR("fail to add port %d\n", i);
+    goto out_free_wq;
+  }
+  ret = x8h7_hook_set(sport->periph, x8h7_uart_hook, sport);
+  if (ret) {
+    DBG_ERROR("fail to set hook for periph %d\n", sport->periph);
+    ret = -EINVAL;
+    goto out_remove_port;
+  }
+  platform_set_drvdata(pdev, sport);
+
+  snprintf(name, sizeof(name), "x8h7_%s%d", x8h7_uart.dev_name, i);
+  sport->dbgfs = debugfs_create_dir(name, NULL);
+  debugfs_create_file("stats", 0444, sport->dbgfs, sport, &x8h7_uart_stats_fops);
+
+  DBG_PRINT("probed line %d periph %d\n", i, sport->periph);
   return 0;
+
+out_remove_port:
+  uart_remove_one_port(&x8h7_uart, &sport->port);
+out_free_wq:
+  destroy_workqueue(sport->workqueue);
+out_free_line:
+  mutex_lock(&x8h7_uart_ports_lock);
+  clear_bit(i, &x8h7_uart_ports_used);
+  mutex_unlock(&x8h7_uart_ports_lock);
+  return ret;
 }
 
 static int x8h7_uart_remove(struct platform_device *pdev)
 {
   struct x8h7_uart_port *sport = platform_get_drvdata(pdev);
 
-  DBG_PRINT("destroying work queue\n");
-  destroy_workqueue(sport->workqueue);
   if (sport) {
+    debugfs_remove_recursive(sport->dbgfs);
     uart_remove_one_port(&x8h7_uart, &sport->port);
+    hrtimer_cancel(&sport->tx_timer);
+    x8h7_hook_set(sport->periph, NULL, NULL);
+    DBG_PRINT("destroying work queue\n");
+    destroy_workqueue(sport->workqueue);
+    mutex_lock(&x8h7_uart_ports_lock);
+    clear_bit(sport->port.line, &x8h7_uart_ports_used);
+    mutex_unlock(&x8h7_uart_ports_lock);
   }
   return 0;
 }